@@ -2,7 +2,15 @@
 #include <algorithm>
 #include <chrono>
 #include <fstream>
+#include <sstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <numeric>
+#include <array>
+#include <atomic>
+#include <functional>
+#include <thread>
 
 #include <cstdio>
 #include <cstdlib>
@@ -13,6 +21,19 @@
 #include <cstring>
 #include <filesystem>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define HAVE_MMAP
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
 #include "cppmidi/cppmidi.h"
 
 static void dbg(const char *msg, ...);
@@ -22,7 +43,7 @@ static void err(const char *msg, ...);
 static void usage() {
     err("midi2agb, version %s\n", GIT_VERSION);
     err("\n");
-    err("Usage: midi2agb [options] <input.mid> [<output.s>]\n\n");
+    err("Usage: midi2agb [options] <input.mid|input.ir> [<output.s>]\n\n");
     err("Options:\n");
     err("-s <sym>      | symbol name for song header (default: file name)\n");
     err("-m <mvl>      | master volume 0..128 (default: 128)\n");
@@ -31,11 +52,39 @@ static void usage() {
     err("-r <rev>      | song reverb 0..127 (default: 0)\n");
     err("-n            | apply natural volume scale\n");
     err("-v            | output debug information\n");
+    err("-j <n>        | threads for pattern detection, 0 = all cores (default: 1)\n");
     err("--modt <val>  | global modulation type 0..2\n");
     err("--modsc <val> | global modulation scale 0.0 - 16.0\n");
     err("--lfos <val>  | global modulation speed 0..127\n");
     err("              | (val * 24 / 256) oscillations per beat\n");
     err("--lfodl <val> | global modulation delay 0..127 ticks\n");
+    err("--echo        | replace baked echo repeats with pseudo echo\n");
+    err("--infer-bars  | find the bar length from the notes if it improves patterns\n");
+    err("--dce         | remove control events no note can hear, defer the others\n");
+    err("--rescale     | halve the tick rate and tempo if all events allow it\n");
+    err("--trim-notes <l> | end held notes once their envelope is below l (of 255)\n");
+    err("--passes <l>  | comma separated passes to run in this order (see README)\n");
+    err("--time-passes | print time and event count after every pass\n");
+    err("--verify      | check the song for consistency after every pass\n");
+    err("--error-report | report the deviation caused by lossy directives\n");
+    err("--auto-tol <e> | pick curve tolerances with an RMS error of at most e\n");
+    err("--save-ir <f> | save parsed MIDI as snapshot for faster re-runs\n");
+    err("--fast-load   | read the MIDI with the built-in vectorized decoder\n");
+    err("--emit-mid <f> | write the converted song back to a MIDI file\n");
+    err("--batch <f>   | convert all songs listed in a manifest file\n");
+    err("--sfx-bank <f> | convert all SFX listed in f into one output file\n");
+    err("--shard <i/N> | only convert the i-th of N size balanced parts\n");
+    err("--summary <f> | summary output file for --batch\n");
+    err("--merge-shards <summaries...> | combine the summaries of all shards\n");
+    err("--vgr-def <f> | voicegroup definition (assembly or mapping file)\n");
+    err("--ds-chn <n>  | DirectSound channels of the engine 1..12 (default: 5)\n");
+    err("--simulate    | simulate channel allocation and report lost notes\n");
+    err("--strip-empty | remove notes on empty voicegroup slots\n");
+    err("--auto-prio   | assign track priorities if channels are overloaded\n");
+    err("--fixed-stream | write fixed-width events for custom players\n");
+    err("--sections    | put each song in its own .rodata.<sym> sections\n");
+    err("--lean-asm    | write plain numbers without comments, assembles faster\n");
+    err("--split-output <n> | write n tracks per file for parallel assembly\n");
     exit(1);
 }
 
@@ -69,6 +118,29 @@ static uint8_t arg_lfodl = 0;
 static bool arg_lfodl_global = false;
 static float arg_mod_scale = 1.0f;
 
+// optimization options
+
+static bool arg_pseudo_echo = false;
+static bool arg_error_report = false;
+static bool arg_infer_bars = false;
+static bool arg_dce = false;
+static bool arg_rescale = false;
+static uint8_t arg_trim_level = 0;
+
+// pass manager options
+static std::string arg_passes;
+static bool arg_time_passes = false;
+static bool arg_verify = false;
+static float arg_auto_tol = 0.0f;
+
+// channel allocation options
+
+static std::filesystem::path arg_vgr_def_file;
+static uint8_t arg_ds_channels = 5;
+static bool arg_simulate = false;
+static bool arg_strip_empty = false;
+static bool arg_auto_prio = false;
+
 static std::filesystem::path arg_input_file;
 static bool arg_input_file_read = false;
 static std::filesystem::path arg_output_file;
@@ -76,24 +148,149 @@ static bool arg_output_file_read = false;
 
 // misc arguments
 
+static std::filesystem::path arg_save_ir_file;
+static bool arg_fast_load = false;
+static std::filesystem::path arg_emit_mid_file;
+static unsigned int arg_jobs = 1;
+static bool arg_fixed_stream = false;
+static bool arg_sections = false;
+static bool arg_lean_asm = false;
+static unsigned int arg_split_output = 0;
+
+// batch arguments
+
+static std::filesystem::path arg_batch_file;
+static std::filesystem::path arg_sfx_bank_file;
+static std::filesystem::path arg_summary_file;
+static uint32_t arg_shard_index = 1;
+static uint32_t arg_shard_count = 1;
+static bool arg_shard_read = false;
+static bool arg_merge_shards = false;
+static std::vector<std::filesystem::path> arg_merge_files;
+
 static bool arg_debug_output = false;
 
+/*
+ * Work counters:
+ *
+ * Building with -DMIDI2AGB_COUNTERS counts how often the inner loops run
+ * and prints the totals after every song. Without it count() is empty and
+ * the counters are never referenced.
+ */
+#ifdef MIDI2AGB_COUNTERS
+static constexpr bool counters_enabled = true;
+#else
+static constexpr bool counters_enabled = false;
+#endif
+
+enum class ctr : size_t {
+    EVENTS_ARGUMENTS, EVENTS_EMPTY_TRACKS, EVENTS_FILTERS, EVENTS_ECHO,
+    EVENTS_DIRECTIVES, EVENTS_LOOP_RESET, EVENTS_RESCALE, EVENTS_REDUNDANT, EVENTS_DEAD,
+    EVENTS_TRIM, EVENTS_TO_AGB,
+    EVENTS_OPTIMIZE, FIND_NEXT_PROBES, NOTE_LENGTH_CALLS, NOTE_LENGTH_STEPS,
+    HASH_PROBES, BAR_COMPARES,
+    // followed by one counter per agb_ev::ty
+    WRITE_EVENT,
+};
+
+static const char *counter_names[] = {
+    "events midi_read_infile_arguments", "events midi_remove_empty_tracks",
+    "events midi_apply_filters", "events midi_apply_pseudo_echo",
+    "events midi_apply_directives", "events midi_apply_loop_and_state_reset",
+    "events midi_rescale_time_base",
+    "events midi_remove_redundant_events", "events midi_remove_dead_events",
+    "events midi_trim_notes",
+    "events midi_to_agb",
+    "events agb_optimize", "find_next_event_at_tick_index probes",
+    "get_note_length calls", "get_note_length steps",
+    "pattern hash probes", "pattern bar compares",
+    "write_event WAIT", "write_event LOOP_START", "write_event LOOP_END",
+    "write_event PRIO", "write_event TEMPO", "write_event KEYSH",
+    "write_event VOICE", "write_event VOL", "write_event PAN",
+    "write_event BEND", "write_event BENDR", "write_event LFOS",
+    "write_event LFODL", "write_event MOD", "write_event MODT",
+    "write_event TUNE", "write_event XCMD", "write_event EOT",
+    "write_event TIE", "write_event NOTE",
+};
+
+static const size_t NUM_COUNTERS = sizeof(counter_names) / sizeof(counter_names[0]);
+static_assert(NUM_COUNTERS == static_cast<size_t>(ctr::WRITE_EVENT) + 20,
+        "counter_names does not match ctr");
+static std::atomic<uint64_t> counters[NUM_COUNTERS];
+
+static inline void count(ctr c, size_t offset = 0) {
+    if constexpr (counters_enabled)
+        counters[static_cast<size_t>(c) + offset].fetch_add(1, std::memory_order_relaxed);
+}
+
+static void counters_report() {
+    if constexpr (counters_enabled) {
+        err("work counters for %s:\n", arg_input_file.string().c_str());
+        for (size_t i = 0; i < NUM_COUNTERS; i++) {
+            uint64_t n = counters[i].exchange(0);
+            if (n > 0)
+                err("  %-40s %12llu\n", counter_names[i],
+                        static_cast<unsigned long long>(n));
+        }
+    }
+}
+
 // 
 
 static cppmidi::midi_file mf;
 
+static bool ir_is_snapshot(const std::filesystem::path& path);
+static void ir_save(const std::filesystem::path& path);
+static void ir_load(const std::filesystem::path& path);
+static void smf_load(const std::filesystem::path& path);
+
 static void midi_read_infile_arguments();
 
 static void midi_remove_empty_tracks();
 static void midi_apply_filters();
+static void midi_apply_pseudo_echo();
+static void midi_apply_directives();
+struct error_track;
+static std::vector<error_track> error_capture();
+static void error_report(const std::vector<error_track>& before,
+        const std::vector<error_track>& after);
 static void midi_apply_loop_and_state_reset();
+static void midi_rescale_time_base();
 static void midi_remove_redundant_events();
+static void midi_remove_dead_events();
+static void midi_trim_notes();
 
-static void midi_to_agb();
+static bool midi_to_agb(bool infer_bars);
 
 static void agb_optimize();
+static void agb_infer_bars();
+
+static void vgr_def_load(const std::filesystem::path& path);
+static int vgr_release_frames(uint8_t voice);
+static int vgr_audible_frames(uint8_t voice, uint8_t vel, uint8_t level);
+static void agb_strip_empty_voices();
+static void agb_auto_prio();
+static void agb_simulate_channels();
+static void agb_emit_midi(const std::filesystem::path& path);
 
 static void write_agb();
+static void write_agb_song(std::ofstream& fout, bool with_tracks = true);
+static void write_agb_split();
+
+// unpaired notes of the MIDI, --verify compares them to the input's
+struct verify_notes {
+    size_t hanging = 0;
+    size_t stray_offs = 0;
+};
+
+static size_t song_num_events(bool agb);
+static verify_notes song_verify(bool agb, const char *after, const verify_notes *input);
+
+static void convert_song();
+static void batch_convert();
+static void sfx_bank_add();
+static void sfx_bank_convert();
+static void batch_merge_summaries();
 
 int main(int argc, char *argv[]) {
     if (argc == 1)
@@ -138,6 +335,15 @@ int main(int argc, char *argv[]) {
                 arg_natural = true;
             } else if (!st.compare("-v")) {
                 arg_debug_output = true;
+            } else if (!st.compare("-j")) {
+                if (++i >= argc)
+                    die("-j: missing parameter\n");
+                int jobs = std::stoi(argv[i]);
+                if (jobs < 0 || jobs > 256)
+                    die("-j: parameter %d out of range\n", jobs);
+                arg_jobs = static_cast<unsigned int>(jobs);
+                if (arg_jobs == 0)
+                    arg_jobs = std::max(1u, std::thread::hardware_concurrency());
             } else if (!st.compare("--modt")) {
                 if (++i >= argc)
                     die("--modt: missing parameter\n");
@@ -169,6 +375,105 @@ int main(int argc, char *argv[]) {
                     die("--lfodl: parameter %d out of range\n", lfodl);
                 arg_lfodl = static_cast<uint8_t>(lfodl);
                 arg_lfodl_global = true;
+            } else if (!st.compare("--echo")) {
+                arg_pseudo_echo = true;
+            } else if (!st.compare("--emit-mid")) {
+                if (++i >= argc)
+                    die("--emit-mid: missing parameter\n");
+                arg_emit_mid_file = argv[i];
+            } else if (!st.compare("--save-ir")) {
+                if (++i >= argc)
+                    die("--save-ir: missing parameter\n");
+                arg_save_ir_file = argv[i];
+            } else if (!st.compare("--fast-load")) {
+                arg_fast_load = true;
+            } else if (!st.compare("--sfx-bank")) {
+                if (++i >= argc)
+                    die("--sfx-bank: missing parameter\n");
+                arg_sfx_bank_file = argv[i];
+            } else if (!st.compare("--batch")) {
+                if (++i >= argc)
+                    die("--batch: missing parameter\n");
+                arg_batch_file = argv[i];
+            } else if (!st.compare("--shard")) {
+                if (++i >= argc)
+                    die("--shard: missing parameter\n");
+                unsigned int index, count;
+                if (sscanf(argv[i], "%u/%u", &index, &count) != 2)
+                    die("--shard: parameter must be i/N\n");
+                if (count < 1 || index < 1 || index > count)
+                    die("--shard: shard %u/%u out of range\n", index, count);
+                arg_shard_index = index;
+                arg_shard_count = count;
+                arg_shard_read = true;
+            } else if (!st.compare("--summary")) {
+                if (++i >= argc)
+                    die("--summary: missing parameter\n");
+                arg_summary_file = argv[i];
+            } else if (!st.compare("--merge-shards")) {
+                arg_merge_shards = true;
+            } else if (!st.compare("--vgr-def")) {
+                if (++i >= argc)
+                    die("--vgr-def: missing parameter\n");
+                arg_vgr_def_file = argv[i];
+            } else if (!st.compare("--ds-chn")) {
+                if (++i >= argc)
+                    die("--ds-chn: missing parameter\n");
+                int chn = std::stoi(argv[i]);
+                if (chn < 1 || chn > 12)
+                    die("--ds-chn: parameter %d out of range\n", chn);
+                arg_ds_channels = static_cast<uint8_t>(chn);
+            } else if (!st.compare("--infer-bars")) {
+                arg_infer_bars = true;
+            } else if (!st.compare("--dce")) {
+                arg_dce = true;
+            } else if (!st.compare("--rescale")) {
+                arg_rescale = true;
+            } else if (!st.compare("--trim-notes")) {
+                if (++i >= argc)
+                    die("--trim-notes: missing parameter\n");
+                int level = std::stoi(argv[i]);
+                if (level < 1 || level > 255)
+                    die("--trim-notes: parameter %d out of range\n", level);
+                arg_trim_level = static_cast<uint8_t>(level);
+            } else if (!st.compare(0, 9, "--passes=")) {
+                arg_passes = st.substr(9);
+            } else if (!st.compare("--passes")) {
+                if (++i >= argc)
+                    die("--passes: missing parameter\n");
+                arg_passes = argv[i];
+            } else if (!st.compare("--time-passes")) {
+                arg_time_passes = true;
+            } else if (!st.compare("--verify")) {
+                arg_verify = true;
+            } else if (!st.compare("--error-report")) {
+                arg_error_report = true;
+            } else if (!st.compare("--auto-tol")) {
+                if (++i >= argc)
+                    die("--auto-tol: missing parameter\n");
+                float tol = std::stof(argv[i]);
+                if (tol < 0.0f || tol > 127.0f)
+                    die("--auto-tol: parameter %f out of range\n", static_cast<double>(tol));
+                arg_auto_tol = tol;
+            } else if (!st.compare("--simulate")) {
+                arg_simulate = true;
+            } else if (!st.compare("--strip-empty")) {
+                arg_strip_empty = true;
+            } else if (!st.compare("--lean-asm")) {
+                arg_lean_asm = true;
+            } else if (!st.compare("--sections")) {
+                arg_sections = true;
+            } else if (!st.compare("--split-output")) {
+                if (++i >= argc)
+                    die("--split-output: missing parameter\n");
+                int tracks = std::stoi(argv[i]);
+                if (tracks < 1 || tracks > 16)
+                    die("--split-output: parameter %d out of range\n", tracks);
+                arg_split_output = static_cast<unsigned int>(tracks);
+            } else if (!st.compare("--fixed-stream")) {
+                arg_fixed_stream = true;
+            } else if (!st.compare("--auto-prio")) {
+                arg_auto_prio = true;
             } else if (!st.compare(0, 2, "-V")) {
                 int mvl = std::stoi(st.substr(2));
                 if (mvl < 0 || mvl > 128)
@@ -195,7 +500,9 @@ int main(int argc, char *argv[]) {
                     if (++i >= argc)
                         die("--: missing file name\n");
                 }
-                if (!arg_input_file_read) {
+                if (arg_merge_shards) {
+                    arg_merge_files.emplace_back(argv[i]);
+                } else if (!arg_input_file_read) {
                     arg_input_file = argv[i];
                     if (arg_input_file.empty())
                         die("empty input file name\n");
@@ -211,45 +518,61 @@ int main(int argc, char *argv[]) {
             }
         }
 
-        // check arguments
-        if (!arg_input_file_read) {
-            die("No input file specified\n");
-        }
-
-        if (!arg_output_file_read) {
-            // create output file name if none is provided
-            arg_output_file = arg_input_file;
-            arg_output_file.replace_extension("s");
-            arg_output_file_read = true;
+        if (arg_merge_shards) {
+            if (arg_merge_files.size() == 0)
+                die("--merge-shards: no summary files specified\n");
+            batch_merge_summaries();
+            return 0;
         }
 
-        if (arg_sym.size() == 0) {
-            // .string() can technically be omitted, but MinGW still wants it :/
-            arg_sym = arg_output_file.filename().replace_extension("").string();
-            fix_str(arg_sym);
-        }
-        if (arg_vgr.size() == 0) {
-            arg_vgr = "voicegroup000";
+        // check arguments
+        if (!arg_sfx_bank_file.empty()) {
+            if (!arg_batch_file.empty())
+                die("--sfx-bank and --batch can't be combined\n");
+            if (arg_output_file_read)
+                die("--sfx-bank: input files are read from the manifest\n");
+            if (!arg_save_ir_file.empty() || !arg_emit_mid_file.empty())
+                die("--sfx-bank: --save-ir and --emit-mid can't be used for multiple songs\n");
+            if (arg_fixed_stream || arg_sections || arg_split_output > 0)
+                die("--sfx-bank: --fixed-stream, --sections and --split-output are not supported\n");
+            // the only file given is the output
+            if (arg_input_file_read) {
+                arg_output_file = arg_input_file;
+            } else {
+                arg_output_file = arg_sfx_bank_file;
+                arg_output_file.replace_extension("s");
+            }
+        } else if (!arg_batch_file.empty()) {
+            if (arg_input_file_read)
+                die("--batch: input files are read from the manifest\n");
+            if (arg_sym.size() > 0)
+                die("--batch: -s can't be used for multiple songs\n");
+            if (!arg_save_ir_file.empty())
+                die("--batch: --save-ir can't be used for multiple songs\n");
+            if (!arg_emit_mid_file.empty())
+                die("--batch: --emit-mid can't be used for multiple songs\n");
+        } else if (!arg_input_file_read) {
+            die("No input file specified\n");
         }
 
-        // load midi file
-        mf.load_from_file(arg_input_file);
-
-        // 24 clocks per quarter note is pretty much the standard for GBA
-        mf.convert_time_division(24);
-
-        midi_read_infile_arguments();
-
-        midi_remove_empty_tracks();
-        midi_apply_filters();
-        midi_apply_loop_and_state_reset();
-        midi_remove_redundant_events();
+        if (arg_batch_file.empty() && (arg_shard_read || !arg_summary_file.empty()))
+            die("--shard and --summary require --batch\n");
 
-        midi_to_agb();
+        if (arg_fixed_stream && arg_split_output > 0)
+            die("--split-output can't be used with --fixed-stream\n");
 
-        agb_optimize();
+        if ((arg_simulate || arg_strip_empty || arg_auto_prio || arg_trim_level > 0) &&
+                arg_vgr_def_file.empty())
+            die("--simulate, --strip-empty, --auto-prio and --trim-notes require --vgr-def\n");
+        if (!arg_vgr_def_file.empty())
+            vgr_def_load(arg_vgr_def_file);
 
-        write_agb();
+        if (!arg_sfx_bank_file.empty())
+            sfx_bank_convert();
+        else if (!arg_batch_file.empty())
+            batch_convert();
+        else
+            convert_song();
     } catch (const cppmidi::xcept& ex) {
         fprintf(stderr, "cppmidi lib error:\n%s\n", ex.what());
         return 1;
@@ -262,6 +585,154 @@ int main(int argc, char *argv[]) {
             std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
 }
 
+/*
+ * Pass manager:
+ *
+ * The passes between loading the MIDI and writing the song are listed in
+ * conversion_passes in their default order. The MIDI passes run before
+ * midi_to_agb, the agb passes after it. --passes selects which of them run
+ * in which order, passes behind an option (like --echo) still do nothing
+ * without it. Required passes restructure the song in ways the following
+ * code relies on and can only be moved.
+ */
+struct conversion_pass {
+    const char *name;
+    void (*run)();
+    bool agb;
+    bool required;
+};
+
+static void midi_apply_directives_reported() {
+    std::vector<error_track> error_before;
+    if (arg_error_report)
+        error_before = error_capture();
+    midi_apply_directives();
+    if (arg_error_report)
+        error_report(error_before, error_capture());
+}
+
+static const conversion_pass conversion_passes[] = {
+    { "empty-tracks", midi_remove_empty_tracks, false, true },
+    { "filters", midi_apply_filters, false, false },
+    { "echo", midi_apply_pseudo_echo, false, false },
+    { "directives", midi_apply_directives_reported, false, false },
+    { "loop-reset", midi_apply_loop_and_state_reset, false, true },
+    { "rescale", midi_rescale_time_base, false, false },
+    { "redundant", midi_remove_redundant_events, false, true },
+    { "dce", midi_remove_dead_events, false, false },
+    { "trim", midi_trim_notes, false, false },
+    { "optimize", agb_optimize, true, true },
+    { "infer-bars", agb_infer_bars, true, false },
+    { "strip-empty", agb_strip_empty_voices, true, false },
+    { "auto-prio", agb_auto_prio, true, false },
+    { "simulate", agb_simulate_channels, true, false },
+};
+
+static std::vector<const conversion_pass *> passes_parse() {
+    std::vector<const conversion_pass *> passes;
+    if (arg_passes.empty()) {
+        for (const conversion_pass& pass : conversion_passes)
+            passes.push_back(&pass);
+        return passes;
+    }
+
+    std::stringstream ss(arg_passes);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        const conversion_pass *found = nullptr;
+        for (const conversion_pass& pass : conversion_passes) {
+            if (name == pass.name)
+                found = &pass;
+        }
+        if (!found)
+            die("--passes: unknown pass \"%s\"\n", name.c_str());
+        if (!found->agb && passes.size() > 0 && passes.back()->agb)
+            die("--passes: MIDI pass \"%s\" has to come before the agb passes\n",
+                    found->name);
+        passes.push_back(found);
+    }
+    for (const conversion_pass& pass : conversion_passes) {
+        if (pass.required &&
+                std::find(passes.begin(), passes.end(), &pass) == passes.end())
+            die("--passes: \"%s\" can't be left out\n", pass.name);
+    }
+    return passes;
+}
+
+// runs one step of the conversion with the checks and timing requested
+static verify_notes passes_run(const char *name, void (*run)(), bool agb,
+        const verify_notes *input) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    if (arg_time_passes) {
+        std::chrono::duration<double, std::milli> ms =
+            std::chrono::steady_clock::now() - start;
+        err("pass %-14s %10.3f ms %10zu events\n", name, ms.count(),
+                song_num_events(agb));
+    }
+    if (arg_verify)
+        return song_verify(agb, name, input);
+    return verify_notes();
+}
+
+static void convert_song() {
+    if (!arg_output_file_read) {
+        // create output file name if none is provided
+        arg_output_file = arg_input_file;
+        arg_output_file.replace_extension("s");
+        arg_output_file_read = true;
+    }
+
+    if (arg_sym.size() == 0) {
+        // .string() can technically be omitted, but MinGW still wants it :/
+        arg_sym = arg_output_file.filename().replace_extension("").string();
+        fix_str(arg_sym);
+    }
+    if (arg_vgr.size() == 0) {
+        arg_vgr = "voicegroup000";
+    }
+
+    const std::vector<const conversion_pass *> passes = passes_parse();
+
+    // the unpaired notes of this song's input are the baseline of --verify
+    const verify_notes input = passes_run("load", []() {
+        if (ir_is_snapshot(arg_input_file)) {
+            // already decoded and converted by a previous run
+            ir_load(arg_input_file);
+        } else {
+            // load midi file
+            if (arg_fast_load)
+                smf_load(arg_input_file);
+            else
+                mf.load_from_file(arg_input_file);
+
+            // 24 clocks per quarter note is pretty much the standard for GBA
+            mf.convert_time_division(24);
+
+            if (!arg_save_ir_file.empty())
+                ir_save(arg_save_ir_file);
+        }
+    }, false, nullptr);
+
+    midi_read_infile_arguments();
+
+    size_t ipass = 0;
+    for (; ipass < passes.size() && !passes[ipass]->agb; ipass++)
+        passes_run(passes[ipass]->name, passes[ipass]->run, false, &input);
+
+    passes_run("to-agb", []() { midi_to_agb(false); }, true, &input);
+
+    for (; ipass < passes.size(); ipass++)
+        passes_run(passes[ipass]->name, passes[ipass]->run, true, &input);
+
+    passes_run("write", write_agb, true, &input);
+
+    if (!arg_emit_mid_file.empty())
+        agb_emit_midi(arg_emit_mid_file);
+
+    counters_report();
+}
+
 static const uint8_t MIDI_CC_EX_BENDR = 20;
 static const uint8_t MIDI_CC_EX_LFOS = 21;
 static const uint8_t MIDI_CC_EX_MODT = 22;
@@ -269,10 +740,30 @@ static const uint8_t MIDI_CC_EX_TUNE = 24;
 static const uint8_t MIDI_CC_EX_LFODL = 26;
 static const uint8_t MIDI_CC_EX_LOOP = 30;
 static const uint8_t MIDI_CC_EX_PRIO = 33;
+static const uint8_t MIDI_CC_EX_XIECV = 34;
+static const uint8_t MIDI_CC_EX_XIECL = 35;
+static const uint8_t MIDI_CC_EX_NOPATT = 40;
+static const uint8_t MIDI_CC_EX_QUANTIZE = 41;
+static const uint8_t MIDI_CC_EX_CURVE_TOL = 42;
+static const uint8_t MIDI_CC_EX_MAXVOICES = 43;
 
 static const uint8_t EX_LOOP_START = 100;
 static const uint8_t EX_LOOP_END = 101;
 
+// optimization presets for the "opt=" directive
+static const struct {
+    uint8_t curve_tol;
+    uint8_t quantize;
+} opt_presets[3] = {
+    { 0, 0 }, // off
+    { 1, 0 }, // safe
+    { 2, 2 }, // aggressive
+};
+
+// extended command types for XCMD, see MPlayDef.s
+static const uint8_t AGB_XCMD_XIECV = 0x08;
+static const uint8_t AGB_XCMD_XIECL = 0x09;
+
 struct agb_ev {
     enum class ty {
         WAIT, LOOP_START, LOOP_END, PRIO, TEMPO, KEYSH, VOICE, VOL, PAN,
@@ -390,7 +881,8 @@ struct agb_ev {
 };
 
 struct agb_bar {
-    agb_bar() : is_referenced(false), does_reference(false) {}
+    agb_bar() : is_referenced(false), does_reference(false), no_pattern(false),
+        ref_track(0), ref_bar(0) {}
     std::vector<agb_ev> events;
     bool operator==(const agb_bar& rhs) const {
         if (events.size() != rhs.events.size())
@@ -420,18 +912,56 @@ struct agb_bar {
         }
         return s;
     }
+    // 64 bit FNV-1a over the events, unlike hash() meant to tell bars of
+    // different songs apart without comparing them
+    uint64_t fingerprint() const {
+        uint64_t fp = 0xcbf29ce484222325ull;
+        auto mix = [&fp](uint32_t x, size_t num_bytes) {
+            for (size_t i = 0; i < num_bytes; i++) {
+                fp ^= (x >> (i * 8)) & 0xFF;
+                fp *= 0x100000001b3ull;
+            }
+        };
+        for (const agb_ev& ev : events) {
+            mix(static_cast<uint32_t>(ev.type), 1);
+            switch (ev.type) {
+            case agb_ev::ty::WAIT:
+                mix(ev.wait, 4);
+                break;
+            case agb_ev::ty::LOOP_START:
+            case agb_ev::ty::LOOP_END:
+                break;
+            case agb_ev::ty::XCMD:
+                mix(ev.xcmd.type, 1);
+                mix(ev.xcmd.par, 1);
+                break;
+            case agb_ev::ty::EOT:
+                mix(ev.eot.key, 1);
+                break;
+            case agb_ev::ty::TIE:
+                mix(ev.tie.key, 1);
+                mix(ev.tie.vel, 1);
+                break;
+            case agb_ev::ty::NOTE:
+                mix(ev.note.len, 1);
+                mix(ev.note.key, 1);
+                mix(ev.note.vel, 1);
+                break;
+            default:
+                // all other events have a single byte parameter
+                mix(ev.prio, 1);
+                break;
+            }
+        }
+        mix(static_cast<uint32_t>(events.size()), 4);
+        return fp;
+    }
     bool is_referenced;
     bool does_reference;
-};
-
-struct agb_bar_ref_hasher {
-    typedef std::reference_wrapper<agb_bar> rw_agb_bar;
-    size_t operator()(const rw_agb_bar& x) const {
-        return x.get().hash();
-    }
-    bool operator()(const rw_agb_bar& a,const rw_agb_bar& b) const {
-        return a.get() == b.get();
-    }
+    // set by the "nopatt" directive
+    bool no_pattern;
+    // pattern which is called instead if does_reference is set
+    size_t ref_track, ref_bar;
 };
 
 struct agb_track {
@@ -469,6 +999,7 @@ static bool find_next_event_at_tick_index(const cppmidi::midi_track& mtrk,
         const size_t start_event, size_t& next_event) {
     size_t next_index = start_event + 1;
     while (1) {
+        count(ctr::FIND_NEXT_PROBES);
         if (next_index >= mtrk.midi_events.size())
             return false;
         if (mtrk[next_index]->ticks > mtrk[start_event]->ticks)
@@ -491,6 +1022,518 @@ static bool find_next_event_at_tick_index(const cppmidi::midi_track& mtrk,
     }
 }
 
+/*
+ * IR Snapshot:
+ *
+ * Decoding the SMF and converting the time division is the same for every
+ * run on the same MIDI, no matter which options are used. The snapshot
+ * stores the song at exactly that point, so it can be fed back as input
+ * file. The in-file arguments are intentionally not applied yet since they
+ * depend on (and override) the command line options.
+ *
+ * Layout (little endian):
+ * - header: "M2AGBIR\0", u32 version, u32 number of tracks
+ * - per track: u32 number of events followed by the events
+ * - event: u32 ticks, u8 kind, u8 channel, u8 a, u8 b, u32 c
+ *   text events are followed by c bytes of text, padded to 4 bytes
+ *
+ * Events that are not used by midi2agb are stored as unused controller
+ * so they still count for trk_get_channel_num().
+ */
+static const char IR_MAGIC[8] = { 'M', '2', 'A', 'G', 'B', 'I', 'R', '\0' };
+static const uint32_t IR_VERSION = 1;
+
+enum class ir_kind : uint8_t {
+    DUMMY, NOTEON, NOTEOFF, CONTROLLER, PROGRAM, PITCHBEND, TEMPO, TIMESIG,
+    MARKER, TEXT, CUEPOINT, UNUSED_MESSAGE,
+};
+
+// unassigned in the MIDI standard and removed by midi_remove_redundant_events
+static const uint8_t IR_UNUSED_CC = 3;
+
+/*
+ * input_map : maps an input file if possible, otherwise reads it in one go
+ */
+struct input_map {
+    input_map(const std::filesystem::path& path, const char *what) {
+#ifdef HAVE_MMAP
+        void *map = MAP_FAILED;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            die("Unable to open %s file: %s\n", what, strerror(errno));
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            size = static_cast<size_t>(st.st_size);
+            map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if (map == MAP_FAILED)
+            die("Unable to map %s file: %s\n", what, strerror(errno));
+        data = static_cast<const uint8_t *>(map);
+#else
+        std::ifstream fin(path, std::ios::binary);
+        if (!fin.is_open())
+            die("Unable to open %s file: %s\n", what, strerror(errno));
+        buf.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+        data = buf.data();
+        size = buf.size();
+#endif
+    }
+    ~input_map() {
+#ifdef HAVE_MMAP
+        munmap(const_cast<uint8_t *>(data), size);
+#endif
+    }
+    input_map(const input_map&) = delete;
+    input_map& operator=(const input_map&) = delete;
+
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+#ifndef HAVE_MMAP
+    std::vector<uint8_t> buf;
+#endif
+};
+
+static bool ir_is_snapshot(const std::filesystem::path& path) {
+    std::ifstream fin(path, std::ios::binary);
+    char magic[sizeof(IR_MAGIC)];
+    if (!fin.read(magic, sizeof(magic)))
+        return false;
+    return memcmp(magic, IR_MAGIC, sizeof(IR_MAGIC)) == 0;
+}
+
+static void ir_save(const std::filesystem::path& path) {
+    using namespace cppmidi;
+
+    std::vector<uint8_t> buf;
+    auto put8 = [&](uint8_t x) { buf.push_back(x); };
+    auto put32 = [&](uint32_t x) {
+        for (int i = 0; i < 4; i++)
+            buf.push_back(static_cast<uint8_t>(x >> (8 * i)));
+    };
+    auto put_ev = [&](uint32_t ticks, ir_kind kind, uint8_t chn, uint8_t a,
+            uint8_t b, uint32_t c) {
+        put32(ticks);
+        put8(static_cast<uint8_t>(kind));
+        put8(chn);
+        put8(a);
+        put8(b);
+        put32(c);
+    };
+    auto put_text = [&](uint32_t ticks, ir_kind kind, const std::string& text) {
+        put_ev(ticks, kind, 0, 0, 0, static_cast<uint32_t>(text.size()));
+        buf.insert(buf.end(), text.begin(), text.end());
+        while (buf.size() % 4)
+            buf.push_back(0);
+    };
+
+    for (char c : IR_MAGIC)
+        put8(static_cast<uint8_t>(c));
+    put32(IR_VERSION);
+    put32(static_cast<uint32_t>(mf.midi_tracks.size()));
+
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        put32(static_cast<uint32_t>(mtrk.midi_events.size()));
+        for (const std::unique_ptr<midi_event>& pev : mtrk.midi_events) {
+            const midi_event& ev = *pev;
+            if (typeid(ev) == typeid(noteon_message_midi_event)) {
+                const noteon_message_midi_event& nev =
+                    static_cast<const noteon_message_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::NOTEON, nev.channel(),
+                        nev.get_key(), nev.get_velocity(), 0);
+            } else if (typeid(ev) == typeid(noteoff_message_midi_event)) {
+                const noteoff_message_midi_event& nev =
+                    static_cast<const noteoff_message_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::NOTEOFF, nev.channel(),
+                        nev.get_key(), nev.get_velocity(), 0);
+            } else if (typeid(ev) == typeid(controller_message_midi_event)) {
+                const controller_message_midi_event& cev =
+                    static_cast<const controller_message_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::CONTROLLER, cev.channel(),
+                        cev.get_controller(), cev.get_value(), 0);
+            } else if (typeid(ev) == typeid(program_message_midi_event)) {
+                const program_message_midi_event& pev =
+                    static_cast<const program_message_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::PROGRAM, pev.channel(),
+                        pev.get_program(), 0, 0);
+            } else if (typeid(ev) == typeid(pitchbend_message_midi_event)) {
+                const pitchbend_message_midi_event& pev =
+                    static_cast<const pitchbend_message_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::PITCHBEND, pev.channel(), 0, 0,
+                        static_cast<uint32_t>(static_cast<int32_t>(pev.get_pitch())));
+            } else if (typeid(ev) == typeid(tempo_meta_midi_event)) {
+                const tempo_meta_midi_event& tev =
+                    static_cast<const tempo_meta_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::TEMPO, 0, 0, 0, tev.get_us_per_beat());
+            } else if (typeid(ev) == typeid(timesignature_meta_midi_event)) {
+                const timesignature_meta_midi_event& tev =
+                    static_cast<const timesignature_meta_midi_event&>(ev);
+                put_ev(ev.ticks, ir_kind::TIMESIG, 0, tev.get_numerator(),
+                        tev.get_denominator(), 0);
+            } else if (typeid(ev) == typeid(marker_meta_midi_event)) {
+                put_text(ev.ticks, ir_kind::MARKER,
+                        static_cast<const marker_meta_midi_event&>(ev).get_text());
+            } else if (typeid(ev) == typeid(text_meta_midi_event)) {
+                put_text(ev.ticks, ir_kind::TEXT,
+                        static_cast<const text_meta_midi_event&>(ev).get_text());
+            } else if (typeid(ev) == typeid(cuepoint_meta_midi_event)) {
+                put_text(ev.ticks, ir_kind::CUEPOINT,
+                        static_cast<const cuepoint_meta_midi_event&>(ev).get_text());
+            } else if (const message_midi_event *mev =
+                    dynamic_cast<const message_midi_event*>(&ev)) {
+                put_ev(ev.ticks, ir_kind::UNUSED_MESSAGE, mev->channel(), 0, 0, 0);
+            } else {
+                put_ev(ev.ticks, ir_kind::DUMMY, 0, 0, 0, 0);
+            }
+        }
+    }
+
+    std::ofstream fout(path, std::ios::out | std::ios::binary);
+    if (!fout.is_open())
+        die("Unable to open IR file: %s\n", strerror(errno));
+    fout.write(reinterpret_cast<const char *>(buf.data()),
+            static_cast<std::streamsize>(buf.size()));
+    if (fout.bad() || fout.fail())
+        die("Unable to write IR file\n");
+}
+
+static void ir_load(const std::filesystem::path& path) {
+    using namespace cppmidi;
+
+    const input_map map(path, "IR");
+    const uint8_t *data = map.data;
+    const size_t size = map.size;
+
+    size_t pos = 0;
+    auto need = [&](size_t n) {
+        if (pos + n > size)
+            die("IR file is truncated\n");
+    };
+    auto get8 = [&]() {
+        need(1);
+        return data[pos++];
+    };
+    auto get32 = [&]() {
+        need(4);
+        uint32_t x = static_cast<uint32_t>(data[pos]) |
+            static_cast<uint32_t>(data[pos + 1]) << 8 |
+            static_cast<uint32_t>(data[pos + 2]) << 16 |
+            static_cast<uint32_t>(data[pos + 3]) << 24;
+        pos += 4;
+        return x;
+    };
+    auto get_text = [&](uint32_t len) {
+        need(len);
+        std::string text(reinterpret_cast<const char *>(data + pos), len);
+        pos += (len + 3) & ~3u;
+        return text;
+    };
+
+    need(sizeof(IR_MAGIC));
+    pos += sizeof(IR_MAGIC);
+    if (get32() != IR_VERSION)
+        die("IR file version mismatch, please recreate it\n");
+
+    // set the time division before adding the already converted events
+    mf.midi_tracks.clear();
+    mf.convert_time_division(24);
+
+    uint32_t num_tracks = get32();
+    for (uint32_t itrk = 0; itrk < num_tracks; itrk++) {
+        mf.midi_tracks.emplace_back();
+        midi_track& mtrk = mf.midi_tracks.back();
+        uint32_t num_events = get32();
+        mtrk.midi_events.reserve(num_events);
+        for (uint32_t ievt = 0; ievt < num_events; ievt++) {
+            uint32_t ticks = get32();
+            ir_kind kind = static_cast<ir_kind>(get8());
+            uint8_t chn = get8();
+            uint8_t a = get8();
+            uint8_t b = get8();
+            uint32_t c = get32();
+            switch (kind) {
+            case ir_kind::DUMMY:
+                mtrk.midi_events.emplace_back(new dummy_midi_event(ticks));
+                break;
+            case ir_kind::NOTEON:
+                mtrk.midi_events.emplace_back(new noteon_message_midi_event(ticks, chn, a, b));
+                break;
+            case ir_kind::NOTEOFF:
+                mtrk.midi_events.emplace_back(new noteoff_message_midi_event(ticks, chn, a, b));
+                break;
+            case ir_kind::CONTROLLER:
+                mtrk.midi_events.emplace_back(new controller_message_midi_event(ticks, chn, a, b));
+                break;
+            case ir_kind::PROGRAM:
+                mtrk.midi_events.emplace_back(new program_message_midi_event(ticks, chn, a));
+                break;
+            case ir_kind::PITCHBEND:
+                mtrk.midi_events.emplace_back(new pitchbend_message_midi_event(ticks, chn,
+                            static_cast<int16_t>(static_cast<int32_t>(c))));
+                break;
+            case ir_kind::TEMPO:
+                mtrk.midi_events.emplace_back(new tempo_meta_midi_event(ticks, c));
+                break;
+            case ir_kind::TIMESIG:
+                mtrk.midi_events.emplace_back(new timesignature_meta_midi_event(ticks, a, b, 24, 8));
+                break;
+            case ir_kind::MARKER:
+                mtrk.midi_events.emplace_back(new marker_meta_midi_event(ticks, get_text(c)));
+                break;
+            case ir_kind::TEXT:
+                mtrk.midi_events.emplace_back(new text_meta_midi_event(ticks, get_text(c)));
+                break;
+            case ir_kind::CUEPOINT:
+                mtrk.midi_events.emplace_back(new cuepoint_meta_midi_event(ticks, get_text(c)));
+                break;
+            case ir_kind::UNUSED_MESSAGE:
+                mtrk.midi_events.emplace_back(new controller_message_midi_event(
+                            ticks, chn, IR_UNUSED_CC, 0));
+                break;
+            default:
+                die("IR file contains invalid event kind %d\n", static_cast<int>(kind));
+            }
+        }
+    }
+}
+
+/*
+ * Built-in SMF decoder (--fast-load):
+ *
+ * Controller heavy MIDIs mostly consist of channel messages in running
+ * status with a one byte delta time, e.g. "dd 07 64 dd 07 63 ...". None of
+ * these bytes has bit 7 set, so a run of them is found with one vector
+ * compare (smf_high_bits()) and decoded with a fixed stride instead of
+ * checking every byte for a status or a continued delta time. Longer delta
+ * times take their length from the same bit mask. The events are created
+ * the same way as for IR snapshots, so the result doesn't depend on the
+ * loader.
+ */
+
+// bit i is set if byte i of the 16 bytes at p has bit 7 set
+static inline uint32_t smf_high_bits(const uint8_t *p) {
+#ifdef HAVE_SSE2
+    return static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))));
+#else
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < 16; i++)
+        mask |= static_cast<uint32_t>(p[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+// number of data bytes following a channel message status
+static inline size_t smf_data_len(uint8_t status) {
+    uint8_t type = status & 0xF0;
+    return (type == 0xC0 || type == 0xD0) ? 1 : 2;
+}
+
+static void smf_add_message(cppmidi::midi_track& mtrk, uint32_t ticks,
+        uint8_t status, uint8_t a, uint8_t b) {
+    using namespace cppmidi;
+
+    uint8_t chn = status & 0xF;
+    switch (status & 0xF0) {
+    case 0x80:
+        mtrk.midi_events.emplace_back(new noteoff_message_midi_event(ticks, chn, a, b));
+        break;
+    case 0x90:
+        if (b == 0)
+            mtrk.midi_events.emplace_back(new noteoff_message_midi_event(ticks, chn, a, 0));
+        else
+            mtrk.midi_events.emplace_back(new noteon_message_midi_event(ticks, chn, a, b));
+        break;
+    case 0xB0:
+        mtrk.midi_events.emplace_back(new controller_message_midi_event(ticks, chn, a, b));
+        break;
+    case 0xC0:
+        mtrk.midi_events.emplace_back(new program_message_midi_event(ticks, chn, a));
+        break;
+    case 0xE0:
+        mtrk.midi_events.emplace_back(new pitchbend_message_midi_event(ticks, chn,
+                    static_cast<int16_t>((a | b << 7) - 0x2000)));
+        break;
+    default:
+        // aftertouch isn't used, but still counts for trk_get_channel_num()
+        mtrk.midi_events.emplace_back(new controller_message_midi_event(
+                    ticks, chn, IR_UNUSED_CC, 0));
+        break;
+    }
+}
+
+static void smf_decode_track(cppmidi::midi_track& mtrk, const uint8_t *p,
+        const uint8_t *end) {
+    using namespace cppmidi;
+
+    auto need = [&](size_t n) {
+        if (static_cast<size_t>(end - p) < n)
+            die("MIDI track is truncated\n");
+    };
+    auto get_vlq = [&]() {
+        uint32_t len;
+        if (end - p >= 16) {
+            // the first byte without bit 7 ends the quantity
+            len = static_cast<uint32_t>(__builtin_ctz(~smf_high_bits(p))) + 1;
+            if (len > 4)
+                die("MIDI track contains invalid variable length quantity\n");
+        } else {
+            len = 1;
+            while (p[len - 1] & 0x80) {
+                if (++len > 4 || static_cast<size_t>(end - p) < len)
+                    die("MIDI track contains invalid variable length quantity\n");
+            }
+        }
+        uint32_t x = 0;
+        for (uint32_t i = 0; i < len; i++)
+            x = x << 7 | (p[i] & 0x7F);
+        p += len;
+        return x;
+    };
+
+    uint32_t ticks = 0;
+    uint8_t status = 0;
+    while (p < end) {
+        if (status != 0 && end - p >= 16) {
+            // run of running status messages with one byte delta times
+            uint32_t mask = smf_high_bits(p);
+            size_t run = mask ? static_cast<size_t>(__builtin_ctz(mask)) : 16;
+            size_t stride = smf_data_len(status) + 1;
+            if (run >= stride) {
+                for (const uint8_t *run_end = p + run - stride; p <= run_end; p += stride) {
+                    ticks += p[0];
+                    smf_add_message(mtrk, ticks, status, p[1], stride == 3 ? p[2] : 0);
+                }
+                continue;
+            }
+        }
+
+        ticks += get_vlq();
+        need(1);
+        if (*p & 0x80) {
+            uint8_t st = *p++;
+            if (st == 0xFF) {
+                need(1);
+                uint8_t type = *p++;
+                need(1);
+                uint32_t len = get_vlq();
+                need(len);
+                std::string text;
+                switch (type) {
+                case 0x2F:
+                    // end of track, ignore anything after it
+                    return;
+                case 0x51:
+                    if (len < 3)
+                        die("MIDI tempo event is too short\n");
+                    mtrk.midi_events.emplace_back(new tempo_meta_midi_event(ticks,
+                                static_cast<uint32_t>(p[0] << 16 | p[1] << 8 | p[2])));
+                    break;
+                case 0x58:
+                    if (len < 4)
+                        die("MIDI time signature event is too short\n");
+                    mtrk.midi_events.emplace_back(new timesignature_meta_midi_event(
+                                ticks, p[0], p[1], p[2], p[3]));
+                    break;
+                case 0x01:
+                case 0x06:
+                case 0x07:
+                    text.assign(reinterpret_cast<const char *>(p), len);
+                    if (type == 0x01)
+                        mtrk.midi_events.emplace_back(new text_meta_midi_event(ticks, text));
+                    else if (type == 0x06)
+                        mtrk.midi_events.emplace_back(new marker_meta_midi_event(ticks, text));
+                    else
+                        mtrk.midi_events.emplace_back(new cuepoint_meta_midi_event(ticks, text));
+                    break;
+                default:
+                    mtrk.midi_events.emplace_back(new dummy_midi_event(ticks));
+                    break;
+                }
+                p += len;
+                continue;
+            } else if (st == 0xF0 || st == 0xF7) {
+                need(1);
+                uint32_t len = get_vlq();
+                need(len);
+                p += len;
+                mtrk.midi_events.emplace_back(new dummy_midi_event(ticks));
+                continue;
+            } else if (st > 0xF0) {
+                die("MIDI track contains invalid status 0x%02X\n", st);
+            }
+            status = st;
+        } else if (status == 0) {
+            die("MIDI track uses running status without a previous status\n");
+        }
+        size_t len = smf_data_len(status);
+        need(len);
+        smf_add_message(mtrk, ticks, status, p[0], len == 2 ? p[1] : 0);
+        p += len;
+    }
+}
+
+static void smf_load(const std::filesystem::path& path) {
+    using namespace cppmidi;
+
+    const input_map map(path, "MIDI");
+    const uint8_t *data = map.data;
+    const size_t size = map.size;
+
+    size_t pos = 0;
+    auto need = [&](size_t n) {
+        if (size - pos < n)
+            die("MIDI file is truncated\n");
+    };
+    auto get16 = [&]() {
+        need(2);
+        uint32_t x = static_cast<uint32_t>(data[pos] << 8 | data[pos + 1]);
+        pos += 2;
+        return x;
+    };
+    auto get32 = [&]() {
+        need(4);
+        uint32_t x = static_cast<uint32_t>(data[pos]) << 24 |
+            static_cast<uint32_t>(data[pos + 1]) << 16 |
+            static_cast<uint32_t>(data[pos + 2]) << 8 |
+            static_cast<uint32_t>(data[pos + 3]);
+        pos += 4;
+        return x;
+    };
+
+    if (get32() != 0x4D546864) // "MThd"
+        die("MIDI file has an invalid header\n");
+    uint32_t header_len = get32();
+    if (header_len < 6)
+        die("MIDI file has an invalid header\n");
+    get16(); // format, all tracks are loaded the same way
+    uint32_t num_tracks = get16();
+    uint32_t time_division = get16();
+    need(header_len - 6);
+    pos += header_len - 6;
+    if (time_division == 0 || (time_division & 0x8000))
+        die("MIDI file uses an unsupported time division\n");
+
+    // set the file's time division before adding the events
+    mf.midi_tracks.clear();
+    mf.convert_time_division(static_cast<uint16_t>(time_division));
+
+    while (mf.midi_tracks.size() < num_tracks) {
+        uint32_t chunk = get32();
+        uint32_t len = get32();
+        need(len);
+        if (chunk == 0x4D54726B) { // "MTrk"
+            mf.midi_tracks.emplace_back();
+            midi_track& mtrk = mf.midi_tracks.back();
+            // most events take 3 or 4 bytes
+            mtrk.midi_events.reserve(len / 3);
+            smf_decode_track(mtrk, data + pos, data + pos + len);
+        }
+        // other chunks are skipped
+        pos += len;
+    }
+}
+
 const uint8_t MIDI_NOTE_PARSE_INIT = 0x0;
 const uint8_t MIDI_NOTE_PARSE_SHORT = 0x1;
 const uint8_t MIDI_NOTE_PARSE_TIE = 0x2;
@@ -509,6 +1552,13 @@ static void midi_read_infile_arguments() {
      * - "lfodl_global=%d": ^ globally
      * - "modscale_global=%f": scales modulation by factor %f
      * - "modt_global=%d": set's modulation type for whole song
+     *
+     * Optimization directives, valid for the track from their position on:
+     * - "nopatt" or "nopatt=%d": disable (1) or enable (0) pattern use
+     * - "quantize=%d": snap events to a grid of %d ticks (0 = off)
+     * - "curve_tol=%d": drop controller curve points within tolerance
+     * - "maxvoices=%d": limit polyphony of the track (0 = unlimited)
+     * - "opt=%d": optimization preset (0 = off, 1 = safe, 2 = aggressive)
      */
     bool found_start = false, found_end = false;
     uint32_t loop_start = 0, loop_end = 0;
@@ -522,6 +1572,7 @@ static void midi_read_infile_arguments() {
     for (size_t itrk = 0; itrk < mf.midi_tracks.size(); itrk++) {
         midi_track& mtrk = mf[itrk];
         for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_ARGUMENTS);
             midi_event& ev = *mtrk[ievt];
             last_event = std::max(ev.ticks, last_event);
             std::string ev_text;
@@ -634,10 +1685,65 @@ static void midi_read_infile_arguments() {
                             ev.ticks, channel, MIDI_CC_EX_PRIO,
                             static_cast<uint8_t>(prio));
                 }
-            } else if (!strncmp(ev_text.c_str(), "modscale_global=", 16)) {
-                arg_mod_scale = std::stof(ev_text.substr(16));
-                arg_mod_scale = std::clamp(arg_mod_scale, 0.0f, 16.0f);
-                // the actual scale get's applied in a seperate filter
+            } else if (!ev_text.compare("nopatt") ||
+                    !strncmp(ev_text.c_str(), "nopatt=", 7)) {
+                int nopatt = 1;
+                if (ev_text.size() > 7)
+                    nopatt = std::stoi(ev_text.substr(7));
+                nopatt = std::clamp(nopatt, 0, 1);
+                int channel = trk_get_channel_num(mtrk);
+                if (channel >= 0) {
+                    mtrk[ievt] = std::make_unique<controller_message_midi_event>(
+                            ev.ticks, channel, MIDI_CC_EX_NOPATT,
+                            static_cast<uint8_t>(nopatt));
+                }
+            } else if (!strncmp(ev_text.c_str(), "quantize=", 9)) {
+                int quantize = std::stoi(ev_text.substr(9));
+                quantize = std::clamp(quantize, 0, 96);
+                int channel = trk_get_channel_num(mtrk);
+                if (channel >= 0) {
+                    mtrk[ievt] = std::make_unique<controller_message_midi_event>(
+                            ev.ticks, channel, MIDI_CC_EX_QUANTIZE,
+                            static_cast<uint8_t>(quantize));
+                }
+            } else if (!strncmp(ev_text.c_str(), "curve_tol=", 10)) {
+                int curve_tol = std::stoi(ev_text.substr(10));
+                curve_tol = std::clamp(curve_tol, 0, 127);
+                int channel = trk_get_channel_num(mtrk);
+                if (channel >= 0) {
+                    mtrk[ievt] = std::make_unique<controller_message_midi_event>(
+                            ev.ticks, channel, MIDI_CC_EX_CURVE_TOL,
+                            static_cast<uint8_t>(curve_tol));
+                }
+            } else if (!strncmp(ev_text.c_str(), "maxvoices=", 10)) {
+                int maxvoices = std::stoi(ev_text.substr(10));
+                maxvoices = std::clamp(maxvoices, 0, 127);
+                int channel = trk_get_channel_num(mtrk);
+                if (channel >= 0) {
+                    mtrk[ievt] = std::make_unique<controller_message_midi_event>(
+                            ev.ticks, channel, MIDI_CC_EX_MAXVOICES,
+                            static_cast<uint8_t>(maxvoices));
+                }
+            } else if (!strncmp(ev_text.c_str(), "opt=", 4)) {
+                int opt = std::stoi(ev_text.substr(4));
+                opt = std::clamp(opt, 0, 2);
+                int channel = trk_get_channel_num(mtrk);
+                if (channel >= 0) {
+                    // ev is replaced below, so save its position first
+                    uint32_t tick = ev.ticks;
+                    mtrk[ievt] = std::make_unique<controller_message_midi_event>(
+                            tick, channel, MIDI_CC_EX_CURVE_TOL,
+                            opt_presets[opt].curve_tol);
+                    mtrk.midi_events.insert(mtrk.midi_events.begin() +
+                            static_cast<long>(++ievt),
+                            std::make_unique<controller_message_midi_event>(
+                                tick, channel, MIDI_CC_EX_QUANTIZE,
+                                opt_presets[opt].quantize));
+                }
+            } else if (!strncmp(ev_text.c_str(), "modscale_global=", 16)) {
+                arg_mod_scale = std::stof(ev_text.substr(16));
+                arg_mod_scale = std::clamp(arg_mod_scale, 0.0f, 16.0f);
+                // the actual scale get's applied in a seperate filter
             } else if (!strncmp(ev_text.c_str(), "sym=", 4)) {
                 arg_sym = ev_text.substr(4);
                 fix_str(arg_sym);
@@ -756,6 +1862,7 @@ static void midi_remove_empty_tracks() {
     // seperate tempo events
     for (midi_track& mtrk : mf.midi_tracks) {
         for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_EMPTY_TRACKS);
             if (typeid(*mtrk[ievt]) == typeid(tempo_meta_midi_event)) {
                 uint32_t tick = mtrk[ievt]->ticks;
                 tempo_track.midi_events.emplace_back(std::move(mtrk[ievt]));
@@ -876,6 +1983,7 @@ static void midi_apply_filters() {
         uint8_t expression = 127;
 
         for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_FILTERS);
             midi_event& ev = *mtrk[ievt];
             if (typeid(ev) == typeid(controller_message_midi_event)) {
                 controller_message_midi_event& ctrl_ev = 
@@ -902,6 +2010,660 @@ static void midi_apply_filters() {
     }
 }
 
+/*
+ * midi_apply_pseudo_echo() :
+ *
+ * A lot of MIDIs "bake" an echo effect by repeating a note a couple of times
+ * with decaying velocity. Each repeat costs note bytes and may occupy
+ * a channel on its own. The engine provides a pseudo echo (xIECV/xIECL)
+ * which keeps a released note at a fixed envelope level for a given amount
+ * of frames instead. This function detects said repeats, removes them and
+ * sets up the pseudo echo for the note they belong to.
+ *
+ * The engine copies the echo parameters from the track on note on, so the
+ * parameters are set right before the note on and are reset before the next
+ * note that doesn't have echo repeats.
+ */
+static void midi_apply_pseudo_echo() {
+    using namespace cppmidi;
+
+    if (!arg_pseudo_echo || mf.midi_tracks.size() == 0)
+        return;
+
+    const size_t min_repeats = 2;
+    const uint32_t max_repeat_interval = 48;
+    const double max_decay_deviation = 0.15;
+
+    // tempo events are all located in the first track at this point
+    std::vector<std::pair<uint32_t, double>> tempo_map;
+    for (const std::unique_ptr<midi_event>& ev : mf[0].midi_events) {
+        if (typeid(*ev) == typeid(tempo_meta_midi_event)) {
+            const tempo_meta_midi_event& tev =
+                static_cast<const tempo_meta_midi_event&>(*ev);
+            tempo_map.emplace_back(ev->ticks, tev.get_bpm());
+        }
+    }
+    auto get_bpm = [&](uint32_t tick) {
+        double bpm = 150.0;
+        for (const auto& tempo : tempo_map) {
+            if (tempo.first > tick)
+                break;
+            bpm = tempo.second;
+        }
+        return bpm;
+    };
+
+    struct echo_note {
+        size_t on_index, off_index;
+        uint32_t on_tick, off_tick;
+        uint8_t key, vel;
+        // repeats of a chain head, 0 for regular notes
+        size_t num_repeats = 0;
+        bool paired = false;
+        bool removed = false;
+        uint8_t echo_vol = 0, echo_len = 0;
+    };
+
+    for (midi_track& mtrk : mf.midi_tracks) {
+        int chn = trk_get_channel_num(mtrk);
+        if (chn < 0)
+            continue;
+
+        std::vector<echo_note> notes;
+        std::vector<std::vector<size_t>> open_notes(128);
+        std::vector<uint32_t> loop_ticks;
+
+        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_ECHO);
+            const midi_event& ev = *mtrk[ievt];
+            if (typeid(ev) == typeid(noteon_message_midi_event)) {
+                const noteon_message_midi_event& noteon_ev =
+                    static_cast<const noteon_message_midi_event&>(ev);
+                echo_note n;
+                n.on_index = ievt;
+                n.off_index = ievt;
+                n.on_tick = ev.ticks;
+                n.off_tick = ev.ticks;
+                n.key = noteon_ev.get_key();
+                n.vel = noteon_ev.get_velocity();
+                open_notes[n.key & 0x7F].push_back(notes.size());
+                notes.push_back(n);
+            } else if (typeid(ev) == typeid(noteoff_message_midi_event)) {
+                const noteoff_message_midi_event& noteoff_ev =
+                    static_cast<const noteoff_message_midi_event&>(ev);
+                std::vector<size_t>& open = open_notes[noteoff_ev.get_key() & 0x7F];
+                if (open.size() == 0)
+                    continue;
+                notes[open.front()].off_index = ievt;
+                notes[open.front()].off_tick = ev.ticks;
+                notes[open.front()].paired = true;
+                open.erase(open.begin());
+            } else if (typeid(ev) == typeid(controller_message_midi_event)) {
+                const controller_message_midi_event& cev =
+                    static_cast<const controller_message_midi_event&>(ev);
+                if (cev.get_controller() == MIDI_CC_EX_LOOP)
+                    loop_ticks.push_back(ev.ticks);
+            }
+        }
+
+        // find chains of repeats with the same key, a constant interval
+        // and decaying velocity. Notes without note off are reported by
+        // midi_to_agb, so don't touch them.
+        std::vector<std::vector<size_t>> notes_by_key(128);
+        for (size_t inote = 0; inote < notes.size(); inote++) {
+            if (notes[inote].paired)
+                notes_by_key[notes[inote].key & 0x7F].push_back(inote);
+        }
+
+        for (const std::vector<size_t>& key_notes : notes_by_key) {
+            for (size_t ihead = 0; ihead < key_notes.size(); ihead++) {
+                echo_note& head = notes[key_notes[ihead]];
+                size_t ilast = ihead;
+                uint32_t interval = 0;
+                double first_decay = 0.0;
+                while (ilast + 1 < key_notes.size()) {
+                    const echo_note& prev = notes[key_notes[ilast]];
+                    const echo_note& next = notes[key_notes[ilast + 1]];
+                    uint32_t next_interval = next.on_tick - prev.on_tick;
+                    if (next.on_tick < prev.off_tick || next.vel >= prev.vel)
+                        break;
+                    if (next_interval == 0 || next_interval > max_repeat_interval)
+                        break;
+                    if (interval != 0 && next_interval != interval)
+                        break;
+                    // echoes decay by a roughly constant factor, which
+                    // seperates them from e.g. random drum velocities
+                    double decay = static_cast<double>(next.vel) / prev.vel;
+                    if (ilast > ihead && std::abs(decay - first_decay) > max_decay_deviation)
+                        break;
+                    if (ilast == ihead)
+                        first_decay = decay;
+                    interval = next_interval;
+                    ilast += 1;
+                }
+                size_t num_repeats = ilast - ihead;
+                if (num_repeats < min_repeats)
+                    continue;
+
+                const echo_note& last = notes[key_notes[ilast]];
+                // don't let the echo cross loop points
+                bool crosses_loop = false;
+                for (uint32_t loop_tick : loop_ticks) {
+                    if (loop_tick > head.on_tick && loop_tick <= last.off_tick)
+                        crosses_loop = true;
+                }
+                if (crosses_loop)
+                    continue;
+
+                // the first repeat determines the echo level relative to
+                // the envelope's peak, the length is measured in frames.
+                // Both are kept at half scale so they fit into 7 bit
+                // controller values, midi_to_agb() doubles them again.
+                const echo_note& first = notes[key_notes[ihead + 1]];
+                double echo_vol = 127.5 * first.vel / head.vel;
+                double echo_len = (last.off_tick - head.off_tick) *
+                    75.0 / get_bpm(head.off_tick);
+                head.num_repeats = num_repeats;
+                head.echo_vol = static_cast<uint8_t>(
+                        std::clamp(std::round(echo_vol), 1.0, 127.0));
+                head.echo_len = static_cast<uint8_t>(
+                        std::clamp(std::round(echo_len), 1.0, 127.0));
+                for (size_t irep = ihead + 1; irep <= ilast; irep++)
+                    notes[key_notes[irep]].removed = true;
+                dbg("pseudo echo: key=%d tick=%u repeats=%zu vol=%d len=%d\n",
+                        head.key, head.on_tick, num_repeats,
+                        head.echo_vol, head.echo_len);
+                ihead = ilast;
+            }
+        }
+
+        // rebuild track with echo repeats removed and echo parameters set
+        std::vector<echo_note*> note_at_index(mtrk.midi_events.size(), nullptr);
+        bool any_echo = false;
+        for (echo_note& n : notes) {
+            if (n.num_repeats > 0)
+                any_echo = true;
+            if (n.removed) {
+                mtrk[n.on_index] = std::make_unique<dummy_midi_event>(n.on_tick);
+                mtrk[n.off_index] = std::make_unique<dummy_midi_event>(n.off_tick);
+            } else {
+                note_at_index[n.on_index] = &n;
+            }
+        }
+        if (!any_echo)
+            continue;
+
+        std::vector<std::unique_ptr<midi_event>> new_events;
+        new_events.reserve(mtrk.midi_events.size() + 16);
+        uint8_t echo_vol = 0, echo_len = 0;
+        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            const echo_note *n = note_at_index[ievt];
+            if (n) {
+                uint32_t tick = mtrk[ievt]->ticks;
+                if (n->echo_vol != echo_vol) {
+                    echo_vol = n->echo_vol;
+                    new_events.emplace_back(new controller_message_midi_event(
+                                tick, static_cast<uint8_t>(chn),
+                                MIDI_CC_EX_XIECV, echo_vol));
+                }
+                if (n->echo_vol != 0 && n->echo_len != echo_len) {
+                    echo_len = n->echo_len;
+                    new_events.emplace_back(new controller_message_midi_event(
+                                tick, static_cast<uint8_t>(chn),
+                                MIDI_CC_EX_XIECL, echo_len));
+                }
+            }
+            new_events.emplace_back(std::move(mtrk[ievt]));
+        }
+        mtrk.midi_events = std::move(new_events);
+    }
+}
+
+enum midi_lane { LANE_VOL, LANE_PAN, LANE_MOD, LANE_BEND, LANE_NONE };
+
+// returns the controller curve an event belongs to, bends in AGB units
+static midi_lane midi_get_lane(const cppmidi::midi_event& ev, int& value) {
+    using namespace cppmidi;
+
+    if (typeid(ev) == typeid(pitchbend_message_midi_event)) {
+        const pitchbend_message_midi_event& pev =
+            static_cast<const pitchbend_message_midi_event&>(ev);
+        value = static_cast<int>(std::round(pev.get_pitch() / 128.0));
+        return LANE_BEND;
+    } else if (typeid(ev) == typeid(controller_message_midi_event)) {
+        const controller_message_midi_event& cev =
+            static_cast<const controller_message_midi_event&>(ev);
+        value = cev.get_value();
+        switch (cev.get_controller()) {
+        case MIDI_CC_MSB_VOLUME: return LANE_VOL;
+        case MIDI_CC_MSB_PAN: return LANE_PAN;
+        case MIDI_CC_MSB_MOD: return LANE_MOD;
+        default: return LANE_NONE;
+        }
+    }
+    return LANE_NONE;
+}
+
+struct lane_point {
+    lane_point(uint32_t tick, int value) : tick(tick), value(value) {}
+    uint32_t tick;
+    int value;
+};
+
+/*
+ * lane_rms() : RMS difference of two controller curves
+ *
+ * Both curves hold their value until the next point. The error is
+ * averaged over the time from the first point until end.
+ */
+static double lane_rms(const std::vector<lane_point>& a,
+        const std::vector<lane_point>& b, uint32_t end) {
+    if (a.empty() && b.empty())
+        return 0.0;
+
+    std::vector<uint32_t> ticks;
+    for (const lane_point& pt : a)
+        ticks.push_back(pt.tick);
+    for (const lane_point& pt : b)
+        ticks.push_back(pt.tick);
+    ticks.push_back(end);
+    std::sort(ticks.begin(), ticks.end());
+    ticks.erase(std::unique(ticks.begin(), ticks.end()), ticks.end());
+
+    // before their first point both curves start where the original starts
+    int va = a.empty() ? b[0].value : a[0].value;
+    int vb = va;
+    size_t ia = 0, ib = 0;
+    double sum = 0.0;
+    const uint32_t start = ticks[0];
+    for (size_t k = 0; k + 1 < ticks.size(); k++) {
+        uint32_t t = ticks[k];
+        if (t >= end)
+            break;
+        while (ia < a.size() && a[ia].tick <= t)
+            va = a[ia++].value;
+        while (ib < b.size() && b[ib].tick <= t)
+            vb = b[ib++].value;
+        double d = va - vb;
+        sum += d * d * (ticks[k + 1] - t);
+    }
+    if (end <= start)
+        return 0.0;
+    return std::sqrt(sum / (end - start));
+}
+
+/*
+ * Error report:
+ *
+ * The directives "quantize", "curve_tol" and "maxvoices" (and "opt") are
+ * lossy. With --error-report the song is captured before and after
+ * midi_apply_directives() and compared: the RMS error of every controller
+ * curve, the largest displacement of a note start or end, and the energy
+ * (velocity^2 * length) of notes which have been dropped.
+ */
+struct error_note {
+    uint32_t tick, len;
+    uint8_t key, vel;
+};
+
+struct error_track {
+    std::vector<lane_point> lanes[LANE_NONE];
+    std::vector<error_note> notes;
+    uint32_t end = 0;
+};
+
+static std::vector<error_track> error_capture() {
+    using namespace cppmidi;
+
+    std::vector<error_track> tracks;
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        tracks.emplace_back();
+        error_track& etrk = tracks.back();
+        if (mtrk.midi_events.size() > 0)
+            etrk.end = mtrk.midi_events.back()->ticks;
+
+        std::vector<std::vector<size_t>> key_notes(128);
+        for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+            int value;
+            midi_lane lane = midi_get_lane(*ev, value);
+            if (lane != LANE_NONE) {
+                etrk.lanes[lane].emplace_back(ev->ticks, value);
+            } else if (typeid(*ev) == typeid(noteon_message_midi_event)) {
+                const noteon_message_midi_event& noteon_ev =
+                    static_cast<const noteon_message_midi_event&>(*ev);
+                key_notes[noteon_ev.get_key() & 0x7F].push_back(etrk.notes.size());
+                etrk.notes.push_back({ev->ticks, 0, noteon_ev.get_key(),
+                        noteon_ev.get_velocity()});
+            } else if (typeid(*ev) == typeid(noteoff_message_midi_event)) {
+                const noteoff_message_midi_event& noteoff_ev =
+                    static_cast<const noteoff_message_midi_event&>(*ev);
+                std::vector<size_t>& notes = key_notes[noteoff_ev.get_key() & 0x7F];
+                if (notes.size() == 0)
+                    continue;
+                error_note& note = etrk.notes[notes.front()];
+                note.len = ev->ticks - note.tick;
+                notes.erase(notes.begin());
+            }
+        }
+    }
+    return tracks;
+}
+
+static void error_report(const std::vector<error_track>& before,
+        const std::vector<error_track>& after) {
+    assert(before.size() == after.size());
+
+    double max_rms[LANE_NONE] = { 0.0, 0.0, 0.0, 0.0 };
+    uint32_t max_displacement = 0;
+    double total_energy = 0.0, dropped_energy = 0.0;
+
+    for (size_t itrk = 0; itrk < before.size(); itrk++) {
+        const error_track& a = before[itrk];
+        const error_track& b = after[itrk];
+
+        double rms[LANE_NONE];
+        for (int lane = 0; lane < LANE_NONE; lane++) {
+            rms[lane] = lane_rms(a.lanes[lane], b.lanes[lane], std::max(a.end, b.end));
+            max_rms[lane] = std::max(max_rms[lane], rms[lane]);
+        }
+
+        // match the notes of each key in order, a note which is closer to the
+        // next original note than to the current one means it was dropped
+        uint32_t displacement = 0;
+        double energy = 0.0, dropped = 0.0;
+        for (unsigned int key = 0; key < 128; key++) {
+            std::vector<const error_note *> na, nb;
+            for (const error_note& n : a.notes)
+                if (n.key == key)
+                    na.push_back(&n);
+            for (const error_note& n : b.notes)
+                if (n.key == key)
+                    nb.push_back(&n);
+            auto dist = [](const error_note *x, const error_note *y) {
+                return x->tick > y->tick ? x->tick - y->tick : y->tick - x->tick;
+            };
+            size_t jb = 0;
+            for (size_t ia = 0; ia < na.size(); ia++) {
+                double e = static_cast<double>(na[ia]->vel) * na[ia]->vel * na[ia]->len;
+                energy += e;
+                bool matched;
+                if (jb >= nb.size())
+                    matched = false;
+                else if (na.size() - ia == nb.size() - jb)
+                    matched = true;
+                else
+                    matched = dist(na[ia], nb[jb]) <= dist(na[ia + 1], nb[jb]);
+                if (!matched) {
+                    dropped += e;
+                    continue;
+                }
+                uint32_t end_a = na[ia]->tick + na[ia]->len;
+                uint32_t end_b = nb[jb]->tick + nb[jb]->len;
+                displacement = std::max(displacement, dist(na[ia], nb[jb]));
+                displacement = std::max(displacement,
+                        end_a > end_b ? end_a - end_b : end_b - end_a);
+                jb++;
+            }
+        }
+        max_displacement = std::max(max_displacement, displacement);
+        total_energy += energy;
+        dropped_energy += dropped;
+
+        err("error report: track %zu: rms vol %.2f pan %.2f mod %.2f bend %.2f, "
+                "max displacement %u ticks, dropped energy %.2f%%\n", itrk,
+                rms[LANE_VOL], rms[LANE_PAN], rms[LANE_MOD], rms[LANE_BEND],
+                displacement, energy > 0.0 ? 100.0 * dropped / energy : 0.0);
+    }
+    err("error report: song: max rms vol %.2f pan %.2f mod %.2f bend %.2f, "
+            "max displacement %u ticks, dropped energy %.2f%%\n",
+            max_rms[LANE_VOL], max_rms[LANE_PAN], max_rms[LANE_MOD], max_rms[LANE_BEND],
+            max_displacement, total_energy > 0.0 ? 100.0 * dropped_energy / total_energy : 0.0);
+}
+
+/*
+ * midi_apply_directives() :
+ *
+ * Applies the lossy optimization directives from the MIDI file to the
+ * tracks and ranges they've been placed in:
+ *
+ * Quantization:
+ * Snaps events to a grid, which reduces the amount of waits. Events don't
+ * move across the loop markers and notes last at least one grid step.
+ *
+ * Curve Tolerance:
+ * Controller curves (volume, pan, modulation and pitch bend) often consist
+ * of a point on every tick. Points which differ less than the tolerance
+ * from the previously kept point are dropped, except for the last point of
+ * a curve so the final value is always reached.
+ *
+ * Max Voices:
+ * Notes exceeding the polyphony limit of the track are dropped.
+ */
+static void midi_apply_directives() {
+    using namespace cppmidi;
+
+    // curve points further apart than this end a curve
+    const uint32_t curve_end_gap = 6;
+
+    for (midi_track& mtrk : mf.midi_tracks) {
+        if (mtrk.midi_events.size() == 0)
+            continue;
+
+        uint32_t track_end = mtrk.midi_events.back()->ticks;
+        uint8_t quantize = 0;
+        uint8_t maxvoices = 0;
+        // --auto-tol applies to tracks without their own curve tolerance
+        bool any_directive = arg_auto_tol > 0.0f;
+        bool has_curve_tol = false;
+        bool needs_sort = false;
+
+        // the loop markers stay in place, quantized events mustn't cross them
+        std::vector<uint32_t> loop_ticks;
+        for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+            if (typeid(*ev) == typeid(controller_message_midi_event) &&
+                    static_cast<const controller_message_midi_event&>(*ev).get_controller()
+                    == MIDI_CC_EX_LOOP)
+                loop_ticks.push_back(ev->ticks);
+        }
+        size_t iloop = 0;
+
+        // for each key the notes currently on
+        struct quantize_note {
+            size_t on_index;
+            uint32_t on_tick;
+            bool dropped;
+        };
+        std::vector<std::vector<quantize_note>> key_notes(128);
+        size_t num_voices = 0;
+
+        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_DIRECTIVES);
+            midi_event& ev = *mtrk[ievt];
+            if (typeid(ev) == typeid(controller_message_midi_event)) {
+                const controller_message_midi_event& cev =
+                    static_cast<const controller_message_midi_event&>(ev);
+                switch (cev.get_controller()) {
+                case MIDI_CC_EX_QUANTIZE:
+                    quantize = cev.get_value();
+                    any_directive = true;
+                    continue;
+                case MIDI_CC_EX_MAXVOICES:
+                    maxvoices = cev.get_value();
+                    any_directive = true;
+                    continue;
+                case MIDI_CC_EX_CURVE_TOL:
+                    any_directive = true;
+                    has_curve_tol = true;
+                    continue;
+                case MIDI_CC_EX_LOOP:
+                    iloop += 1;
+                    continue;
+                case MIDI_CC_EX_NOPATT:
+                    continue;
+                default:
+                    break;
+                }
+            } else if (typeid(ev) == typeid(dummy_midi_event)) {
+                continue;
+            }
+
+            // events may snap onto a loop marker, but not past it
+            uint32_t min_tick = iloop > 0 ? loop_ticks[iloop - 1] : 0;
+            uint32_t max_tick = iloop < loop_ticks.size() ? loop_ticks[iloop] : track_end;
+            if (quantize > 0) {
+                uint32_t q = quantize;
+                uint32_t ticks = (ev.ticks + q / 2) / q * q;
+                ticks = std::clamp(ticks, min_tick, max_tick);
+                if (ticks != ev.ticks) {
+                    ev.ticks = ticks;
+                    needs_sort = true;
+                }
+            }
+
+            if (typeid(ev) == typeid(noteon_message_midi_event)) {
+                const noteon_message_midi_event& noteon_ev =
+                    static_cast<const noteon_message_midi_event&>(ev);
+                bool drop = maxvoices > 0 && num_voices >= maxvoices;
+                key_notes[noteon_ev.get_key() & 0x7F].push_back({ievt, ev.ticks, drop});
+                if (drop)
+                    mtrk[ievt] = std::make_unique<dummy_midi_event>(ev.ticks);
+                else
+                    num_voices += 1;
+            } else if (typeid(ev) == typeid(noteoff_message_midi_event)) {
+                const noteoff_message_midi_event& noteoff_ev =
+                    static_cast<const noteoff_message_midi_event&>(ev);
+                std::vector<quantize_note>& notes = key_notes[noteoff_ev.get_key() & 0x7F];
+                if (notes.size() == 0)
+                    continue;
+                quantize_note note = notes.front();
+                notes.erase(notes.begin());
+                if (!note.dropped && ev.ticks <= note.on_tick && quantize > 0) {
+                    // a short note snapped to a single grid point lasts
+                    // until the next one, or is dropped if there is none
+                    ev.ticks = std::min(note.on_tick + quantize, max_tick);
+                    needs_sort = true;
+                    if (ev.ticks <= note.on_tick) {
+                        mtrk[note.on_index] = std::make_unique<dummy_midi_event>(note.on_tick);
+                        note.dropped = true;
+                        num_voices -= 1;
+                    }
+                }
+                if (note.dropped)
+                    mtrk[ievt] = std::make_unique<dummy_midi_event>(ev.ticks);
+                else
+                    num_voices -= 1;
+            }
+        }
+
+        if (!any_directive)
+            continue;
+
+        if (needs_sort) {
+            std::stable_sort(mtrk.midi_events.begin(), mtrk.midi_events.end(),
+                    ev_tick_cmp);
+        }
+
+        // curve thinning, this needs to know the next point of each curve
+        std::vector<size_t> next_in_lane(mtrk.midi_events.size(), SIZE_MAX);
+        {
+            size_t last_in_lane[LANE_NONE] = { SIZE_MAX, SIZE_MAX, SIZE_MAX, SIZE_MAX };
+            for (size_t ievt = mtrk.midi_events.size(); ievt-- > 0; ) {
+                int value;
+                midi_lane lane = midi_get_lane(*mtrk[ievt], value);
+                if (lane == LANE_NONE)
+                    continue;
+                next_in_lane[ievt] = last_in_lane[lane];
+                last_in_lane[lane] = ievt;
+            }
+        }
+
+        // marks the points to drop, default_tol applies until the first
+        // curve_tol directive
+        auto thin_curves = [&](uint8_t default_tol, std::vector<bool>& drop) {
+            uint8_t curve_tol = default_tol;
+            bool lane_init[LANE_NONE] = { false, false, false, false };
+            int lane_value[LANE_NONE] = { 0, 0, 0, 0 };
+            drop.assign(mtrk.midi_events.size(), false);
+            for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+                count(ctr::EVENTS_DIRECTIVES);
+                const midi_event& ev = *mtrk[ievt];
+                if (typeid(ev) == typeid(controller_message_midi_event)) {
+                    const controller_message_midi_event& cev =
+                        static_cast<const controller_message_midi_event&>(ev);
+                    if (cev.get_controller() == MIDI_CC_EX_CURVE_TOL) {
+                        curve_tol = cev.get_value();
+                        continue;
+                    }
+                }
+                int value;
+                midi_lane lane = midi_get_lane(ev, value);
+                if (lane == LANE_NONE)
+                    continue;
+                bool curve_end = next_in_lane[ievt] == SIZE_MAX ||
+                    mtrk[next_in_lane[ievt]]->ticks > ev.ticks + curve_end_gap;
+                if (curve_tol > 0 && lane_init[lane] && !curve_end &&
+                        std::abs(value - lane_value[lane]) <= curve_tol) {
+                    drop[ievt] = true;
+                    continue;
+                }
+                lane_init[lane] = true;
+                lane_value[lane] = value;
+            }
+        };
+
+        std::vector<bool> drop;
+        uint8_t default_tol = 0;
+        if (arg_auto_tol > 0.0f && !has_curve_tol) {
+            // largest tolerance whose worst curve stays below the ceiling
+            std::vector<lane_point> lanes[LANE_NONE];
+            for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+                int value;
+                midi_lane lane = midi_get_lane(*ev, value);
+                if (lane != LANE_NONE)
+                    lanes[lane].emplace_back(ev->ticks, value);
+            }
+            auto thinned_error = [&](uint8_t tol) {
+                thin_curves(tol, drop);
+                std::vector<lane_point> thinned[LANE_NONE];
+                for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+                    int value;
+                    midi_lane lane = midi_get_lane(*mtrk[ievt], value);
+                    if (lane != LANE_NONE && !drop[ievt])
+                        thinned[lane].emplace_back(mtrk[ievt]->ticks, value);
+                }
+                double error = 0.0;
+                for (int lane = 0; lane < LANE_NONE; lane++)
+                    error = std::max(error, lane_rms(lanes[lane], thinned[lane], track_end));
+                return error;
+            };
+            bool has_curves = false;
+            for (int lane = 0; lane < LANE_NONE; lane++)
+                has_curves = has_curves || lanes[lane].size() > 1;
+            uint8_t lo = 0, hi = has_curves ? 127 : 0;
+            while (lo < hi) {
+                uint8_t mid = static_cast<uint8_t>((lo + hi + 1) / 2);
+                if (thinned_error(mid) <= arg_auto_tol)
+                    lo = mid;
+                else
+                    hi = static_cast<uint8_t>(mid - 1);
+            }
+            default_tol = lo;
+            if (has_curves)
+                dbg("directives: automatic curve tolerance %d\n", default_tol);
+        }
+
+        thin_curves(default_tol, drop);
+        size_t num_thinned = 0;
+        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            if (!drop[ievt])
+                continue;
+            mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
+            num_thinned += 1;
+        }
+        dbg("directives: thinned %zu curve points\n", num_thinned);
+    }
+}
+
 static void midi_apply_loop_and_state_reset() {
     using namespace cppmidi;
 
@@ -917,12 +2679,15 @@ static void midi_apply_loop_and_state_reset() {
         uint8_t modt = 0;
         uint8_t tune = 0x40;
         uint8_t prio = 0;
-        // FIXME add memacc and pseudo echo for completeness
+        uint8_t echo_vol = 0;
+        uint8_t echo_len = 0;
+        // FIXME add memacc for completeness
         // omitted for now because nobody would be using it
 
         uint32_t loop_start_tick = 0xFFFFFFFF;
 
         for (size_t itrk = 0; itrk < mtrk.midi_events.size(); itrk++) {
+            count(ctr::EVENTS_LOOP_RESET);
             midi_event& ev = *mtrk[itrk];
             if (typeid(ev) == typeid(tempo_meta_midi_event)) {
                 tempo_meta_midi_event& tev = static_cast<tempo_meta_midi_event&>(ev);
@@ -970,6 +2735,14 @@ static void midi_apply_loop_and_state_reset() {
                     if (ev.ticks <= loop_start_tick)
                         prio = cev.get_value();
                     break;
+                case MIDI_CC_EX_XIECV:
+                    if (ev.ticks <= loop_start_tick)
+                        echo_vol = cev.get_value();
+                    break;
+                case MIDI_CC_EX_XIECL:
+                    if (ev.ticks <= loop_start_tick)
+                        echo_len = cev.get_value();
+                    break;
                 case MIDI_CC_EX_LOOP:
                     if (cev.get_value() == EX_LOOP_START) {
                         // loop start
@@ -1008,6 +2781,12 @@ static void midi_apply_loop_and_state_reset() {
                         ptrs.emplace_back(new controller_message_midi_event(
                                     ev.ticks, cev.channel(),
                                     MIDI_CC_EX_PRIO, prio));
+                        ptrs.emplace_back(new controller_message_midi_event(
+                                    ev.ticks, cev.channel(),
+                                    MIDI_CC_EX_XIECV, echo_vol));
+                        ptrs.emplace_back(new controller_message_midi_event(
+                                    ev.ticks, cev.channel(),
+                                    MIDI_CC_EX_XIECL, echo_len));
                         mtrk.midi_events.insert(mtrk.midi_events.begin() +
                                 static_cast<long>(itrk),
                                 std::make_move_iterator(ptrs.begin()),
@@ -1024,40 +2803,202 @@ static void midi_apply_loop_and_state_reset() {
 }
 
 /*
- * Does what it says. Removes events that are not required to
- * reduces storage size
+ * Dividing all event times by a factor and slowing the tempo down by the
+ * same factor doesn't change the song, but the engine processes fewer ticks
+ * per frame and waits and note lengths get shorter. This is only possible
+ * if all events lie on the coarser grid, the time signatures can express
+ * the shorter bars and the tempos still fit into TEMPO without getting
+ * (noticeably) less accurate. LFO speed and delay count in ticks as well.
+ * Without --rescale this is only done for tempos above 510 bpm, which don't
+ * fit into TEMPO at all.
  */
-static void midi_remove_redundant_events() {
-    using namespace cppmidi;
+static const double RESCALE_MAX_TEMPO_ERROR = 0.005;
 
-    for (midi_track& mtrk : mf.midi_tracks) {
-        uint8_t tempo = 150 / 2;
-        uint8_t voice = 0;
-        bool voice_init = false;
-        uint8_t vol = 127;
-        bool vol_init = false;
-        uint8_t pan = 0x40;
-        int8_t bend = 0;
-        uint8_t bendr = 2;
-        uint8_t mod = 0;
-        uint8_t modt = 0;
-        uint8_t tune = 0x40;
-        uint8_t prio = 0;
-        uint8_t lfodl = 0;
-        uint8_t lfos = 22;
+static void midi_rescale_time_base() {
+    using namespace cppmidi;
 
-        size_t dummy;
+    if (mf.midi_tracks.size() == 0)
+        return;
 
-        /*
-         * For various event types: Delete an event if it doesn't change
-         * the MIDI state in any way. An event may also be deleted if an
-         * event of the same type follows within the same tick. However,
-         * do not do this for voice events since this may cause wrong
-         * instruments to play. (fixes #2)
-         */
+    // tempo events are all located in the first track at this point and
+    // midi_to_agb() only takes the time signatures from there
+    bool tempo_init = false, time_signature_init = false;
+    for (size_t ievt = 0; ievt < mf[0].midi_events.size() && mf[0][ievt]->ticks == 0; ievt++) {
+        const midi_event& ev = *mf[0][ievt];
+        if (typeid(ev) == typeid(tempo_meta_midi_event))
+            tempo_init = true;
+        else if (typeid(ev) == typeid(timesignature_meta_midi_event))
+            time_signature_init = true;
+    }
 
-        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
-            midi_event& ev = *mtrk.midi_events[ievt];
+    // the engine starts with 150 bpm and the bar table with 4/4
+    uint32_t grid = 0;
+    bool overflow = false;
+    std::vector<double> bpms;
+    std::vector<std::pair<uint32_t, uint32_t>> time_signatures;
+    if (!tempo_init)
+        bpms.push_back(150.0);
+    if (!time_signature_init)
+        time_signatures.emplace_back(4, 2);
+    std::vector<uint8_t> lfos_values, lfodl_values;
+    std::vector<bool> uses_mod(mf.midi_tracks.size(), false);
+    for (size_t itrk = 0; itrk < mf.midi_tracks.size(); itrk++) {
+        for (const std::unique_ptr<midi_event>& pev : mf[itrk].midi_events) {
+            count(ctr::EVENTS_RESCALE);
+            const midi_event& ev = *pev;
+            grid = std::gcd(grid, ev.ticks);
+            if (typeid(ev) == typeid(tempo_meta_midi_event)) {
+                double bpm = static_cast<const tempo_meta_midi_event&>(ev).get_bpm();
+                bpms.push_back(bpm);
+                if (std::round(bpm * 0.5) > 255.0)
+                    overflow = true;
+            } else if (typeid(ev) == typeid(timesignature_meta_midi_event) && itrk == 0) {
+                const timesignature_meta_midi_event& tev =
+                    static_cast<const timesignature_meta_midi_event&>(ev);
+                time_signatures.emplace_back(tev.get_numerator(), tev.get_denominator());
+            } else if (typeid(ev) == typeid(controller_message_midi_event)) {
+                const controller_message_midi_event& cev =
+                    static_cast<const controller_message_midi_event&>(ev);
+                if (cev.get_controller() == MIDI_CC_EX_LFOS)
+                    lfos_values.push_back(cev.get_value());
+                else if (cev.get_controller() == MIDI_CC_EX_LFODL)
+                    lfodl_values.push_back(cev.get_value());
+                else if (cev.get_controller() == MIDI_CC_MSB_MOD && cev.get_value() > 0)
+                    uses_mod[itrk] = true;
+            }
+        }
+    }
+
+    if (!arg_rescale && !overflow)
+        return;
+
+    auto factor_ok = [&](uint32_t factor, uint32_t shift) {
+        if (grid % factor != 0)
+            return false;
+        for (double bpm : bpms) {
+            double scaled = std::round(bpm / (2.0 * factor));
+            if (scaled < 1.0 || scaled > 255.0)
+                return false;
+            double unscaled = std::clamp(std::round(bpm * 0.5), 0.0, 255.0);
+            double error = std::abs(scaled * 2.0 * factor - bpm);
+            if (error > std::max(std::abs(unscaled * 2.0 - bpm), bpm * RESCALE_MAX_TEMPO_ERROR))
+                return false;
+        }
+        for (const auto& ts : time_signatures) {
+            // bar length is numerator * 96 / 2^denominator
+            if (ts.second + shift > 31 || (ts.first * 96) % (1u << (ts.second + shift)) != 0)
+                return false;
+        }
+        for (uint8_t lfos : lfos_values) {
+            if (lfos * factor > 127)
+                return false;
+        }
+        for (uint8_t lfodl : lfodl_values) {
+            if (lfodl % factor != 0)
+                return false;
+        }
+        return true;
+    };
+
+    uint32_t factor = 1, shift = 0;
+    for (uint32_t s = 2; s > 0; s--) {
+        if (factor_ok(1u << s, s)) {
+            factor = 1u << s;
+            shift = s;
+            break;
+        }
+    }
+    if (factor == 1) {
+        if (overflow)
+            dbg("warning, tempo above 510 bpm and the song can't be rescaled\n");
+        return;
+    }
+
+    for (size_t itrk = 0; itrk < mf.midi_tracks.size(); itrk++) {
+        midi_track& mtrk = mf[itrk];
+        bool lfos_init = false;
+        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            midi_event& ev = *mtrk[ievt];
+            ev.ticks /= factor;
+            if (typeid(ev) == typeid(tempo_meta_midi_event)) {
+                tempo_meta_midi_event& tev = static_cast<tempo_meta_midi_event&>(ev);
+                tev.set_us_per_beat(tev.get_us_per_beat() * factor);
+            } else if (typeid(ev) == typeid(timesignature_meta_midi_event)) {
+                const timesignature_meta_midi_event& tev =
+                    static_cast<const timesignature_meta_midi_event&>(ev);
+                mtrk[ievt] = std::make_unique<timesignature_meta_midi_event>(ev.ticks,
+                        tev.get_numerator(), static_cast<uint8_t>(tev.get_denominator() + shift),
+                        24, 8);
+            } else if (typeid(ev) == typeid(controller_message_midi_event)) {
+                controller_message_midi_event& cev =
+                    static_cast<controller_message_midi_event&>(ev);
+                if (cev.get_controller() == MIDI_CC_EX_LFOS) {
+                    cev.set_value(static_cast<uint8_t>(cev.get_value() * factor));
+                    if (cev.ticks == 0)
+                        lfos_init = true;
+                } else if (cev.get_controller() == MIDI_CC_EX_LFODL) {
+                    cev.set_value(static_cast<uint8_t>(cev.get_value() / factor));
+                }
+            }
+        }
+        // the engine's default LFO speed has to be scaled as well
+        int chn = trk_get_channel_num(mtrk);
+        if (uses_mod[itrk] && !lfos_init && chn >= 0) {
+            mtrk.midi_events.emplace(mtrk.midi_events.begin(),
+                    new controller_message_midi_event(0, static_cast<uint8_t>(chn),
+                        MIDI_CC_EX_LFOS, static_cast<uint8_t>(22 * factor)));
+        }
+    }
+    if (!time_signature_init) {
+        mf[0].midi_events.emplace(mf[0].midi_events.begin(),
+                new timesignature_meta_midi_event(0, 4, static_cast<uint8_t>(2 + shift), 24, 8));
+    }
+    if (!tempo_init) {
+        mf[0].midi_events.emplace(mf[0].midi_events.begin(),
+                new tempo_meta_midi_event(0, 400000 * factor));
+    }
+    dbg("rescale: divided time base by %u (%u ticks per quarter note)\n",
+            factor, 24 / factor);
+}
+
+/*
+ * Does what it says. Removes events that are not required to
+ * reduces storage size
+ */
+static void midi_remove_redundant_events() {
+    using namespace cppmidi;
+
+    for (midi_track& mtrk : mf.midi_tracks) {
+        uint8_t tempo = 150 / 2;
+        uint8_t voice = 0;
+        bool voice_init = false;
+        uint8_t vol = 127;
+        bool vol_init = false;
+        uint8_t pan = 0x40;
+        int8_t bend = 0;
+        uint8_t bendr = 2;
+        uint8_t mod = 0;
+        uint8_t modt = 0;
+        uint8_t tune = 0x40;
+        uint8_t prio = 0;
+        uint8_t lfodl = 0;
+        uint8_t lfos = 22;
+        uint8_t echo_vol = 0;
+        uint8_t echo_len = 0;
+
+        size_t dummy;
+
+        /*
+         * For various event types: Delete an event if it doesn't change
+         * the MIDI state in any way. An event may also be deleted if an
+         * event of the same type follows within the same tick. However,
+         * do not do this for voice events since this may cause wrong
+         * instruments to play. (fixes #2)
+         */
+
+        for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_REDUNDANT);
+            midi_event& ev = *mtrk.midi_events[ievt];
             if (typeid(ev) == typeid(tempo_meta_midi_event)) {
                 tempo_meta_midi_event& tev = static_cast<tempo_meta_midi_event&>(ev);
                 double halved_bpm = std::round(tev.get_bpm() * 0.5);
@@ -1174,6 +3115,15 @@ static void midi_remove_redundant_events() {
                         mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
                     }
                     break;
+                case MIDI_CC_EX_NOPATT:
+                    // required for midi_to_agb
+                    break;
+                case MIDI_CC_EX_QUANTIZE:
+                case MIDI_CC_EX_CURVE_TOL:
+                case MIDI_CC_EX_MAXVOICES:
+                    // already applied by midi_apply_directives
+                    mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
+                    break;
                 case MIDI_CC_EX_PRIO:
                     if ((prio == cev.get_value()) ||
                             find_next_event_at_tick_index<controller_message_midi_event,
@@ -1183,6 +3133,24 @@ static void midi_remove_redundant_events() {
                         prio = cev.get_value();
                     }
                     break;
+                case MIDI_CC_EX_XIECV:
+                    if ((echo_vol == cev.get_value()) ||
+                            find_next_event_at_tick_index<controller_message_midi_event,
+                            MIDI_CC_EX_XIECV>(mtrk, ievt, dummy)) {
+                        mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
+                    } else {
+                        echo_vol = cev.get_value();
+                    }
+                    break;
+                case MIDI_CC_EX_XIECL:
+                    if ((echo_len == cev.get_value()) ||
+                            find_next_event_at_tick_index<controller_message_midi_event,
+                            MIDI_CC_EX_XIECL>(mtrk, ievt, dummy)) {
+                        mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
+                    } else {
+                        echo_len = cev.get_value();
+                    }
+                    break;
                 default:
                     dbg("Removing MIDI event of type: %s\n", typeid(ev).name());
                     mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
@@ -1202,6 +3170,380 @@ static void midi_remove_redundant_events() {
     } // end track for loop
 }
 
+/*
+ * midi_remove_dead_events() :
+ *
+ * midi_remove_redundant_events() only looks at the values. This pass looks
+ * at who observes them: VOL, PAN, BEND, MOD and TUNE act on the notes that
+ * are sounding (including their release), VOICE, PRIO and the pseudo echo
+ * parameters only on following Note ONs. A control event is dead if no note
+ * observes it before the next event of its kind overwrites it, e.g. bends
+ * during rests or automation after the last note. Dead events are removed,
+ * live ones made during silence are deferred to the Note ON which observes
+ * them first. Notes played at volume 0 are removed as well.
+ *
+ * The track is treated as a loop from LOOP_END back to LOOP_START, so events
+ * before LOOP_END (including the state restore) stay alive if the start of
+ * the loop observes them. The release is taken from the voicegroup
+ * definition, without one every note is assumed to fade within a bar.
+ * Notes without Note OFF are assumed to never stop.
+ */
+static void midi_remove_dead_events() {
+    using namespace cppmidi;
+
+    if (!arg_dce || mf.midi_tracks.size() == 0)
+        return;
+
+    const uint32_t default_release_ticks = 96;
+
+    // tempo events are all located in the first track at this point
+    std::vector<std::pair<uint32_t, double>> tempo_map;
+    for (const std::unique_ptr<midi_event>& ev : mf[0].midi_events) {
+        if (typeid(*ev) == typeid(tempo_meta_midi_event)) {
+            const tempo_meta_midi_event& tev =
+                static_cast<const tempo_meta_midi_event&>(*ev);
+            tempo_map.emplace_back(ev->ticks, tev.get_bpm());
+        }
+    }
+    auto get_bpm = [&](uint32_t tick) {
+        double bpm = 150.0;
+        for (const auto& tempo : tempo_map) {
+            if (tempo.first > tick)
+                break;
+            bpm = tempo.second;
+        }
+        return bpm;
+    };
+
+    // lanes which sounding notes observe and lanes only read on Note ON
+    enum dce_lane {
+        DCE_VOL, DCE_PAN, DCE_BEND, DCE_MOD, DCE_TUNE,
+        DCE_VOICE, DCE_PRIO, DCE_XIECV, DCE_XIECL, DCE_NUM_LANES, DCE_NONE
+    };
+    auto get_lane = [](const midi_event& ev) {
+        if (typeid(ev) == typeid(pitchbend_message_midi_event))
+            return DCE_BEND;
+        if (typeid(ev) == typeid(program_message_midi_event))
+            return DCE_VOICE;
+        if (typeid(ev) != typeid(controller_message_midi_event))
+            return DCE_NONE;
+        switch (static_cast<const controller_message_midi_event&>(ev).get_controller()) {
+        case MIDI_CC_MSB_VOLUME: return DCE_VOL;
+        case MIDI_CC_MSB_PAN: return DCE_PAN;
+        case MIDI_CC_MSB_MOD: return DCE_MOD;
+        case MIDI_CC_EX_TUNE: return DCE_TUNE;
+        case MIDI_CC_EX_PRIO: return DCE_PRIO;
+        case MIDI_CC_EX_XIECV: return DCE_XIECV;
+        case MIDI_CC_EX_XIECL: return DCE_XIECL;
+        default: return DCE_NONE;
+        }
+    };
+
+    size_t num_removed = 0, num_deferred = 0, num_notes = 0;
+
+    for (midi_track& mtrk : mf.midi_tracks) {
+        const size_t num_events = mtrk.midi_events.size();
+        size_t loop_start = num_events, loop_end = num_events;
+        for (size_t ievt = 0; ievt < num_events; ievt++) {
+            const midi_event& ev = *mtrk[ievt];
+            if (typeid(ev) != typeid(controller_message_midi_event))
+                continue;
+            const controller_message_midi_event& cev =
+                static_cast<const controller_message_midi_event&>(ev);
+            if (cev.get_controller() != MIDI_CC_EX_LOOP)
+                continue;
+            if (cev.get_value() == EX_LOOP_START)
+                loop_start = ievt;
+            else if (cev.get_value() == EX_LOOP_END && loop_start < ievt)
+                loop_end = ievt;
+        }
+        // nothing after LOOP_END is ever played
+        const size_t flow_end = loop_end;
+        const bool has_loop = loop_end < num_events;
+
+        /*
+         * Pair notes and find out how long they stay audible. Notes at volume
+         * 0 are dropped if the volume doesn't change until they're silent.
+         */
+        std::vector<uint32_t> audible_end(num_events, 0);
+        std::vector<bool> is_note(num_events, false);
+        std::vector<bool> dead(num_events, false);
+        std::vector<size_t> vol_events;
+        uint8_t voice = 0, vol = 127, echo_vol = 0, echo_len = 0;
+        bool vol_init = false;
+        std::vector<std::pair<size_t, size_t>> silent_notes;
+        bool loop_hanging = false;
+        for (size_t ievt = 0; ievt < flow_end; ievt++) {
+            count(ctr::EVENTS_DEAD);
+            const midi_event& ev = *mtrk[ievt];
+            dce_lane lane = get_lane(ev);
+            if (lane == DCE_VOICE) {
+                voice = static_cast<const program_message_midi_event&>(ev).get_program();
+            } else if (lane == DCE_VOL) {
+                vol = static_cast<const controller_message_midi_event&>(ev).get_value();
+                vol_init = true;
+                vol_events.push_back(ievt);
+            } else if (lane == DCE_XIECV) {
+                echo_vol = static_cast<const controller_message_midi_event&>(ev).get_value();
+            } else if (lane == DCE_XIECL) {
+                echo_len = static_cast<const controller_message_midi_event&>(ev).get_value();
+            }
+            if (typeid(ev) != typeid(noteon_message_midi_event))
+                continue;
+            const noteon_message_midi_event& noteon_ev =
+                static_cast<const noteon_message_midi_event&>(ev);
+            size_t off_index = ievt + 1;
+            for (; off_index < num_events; off_index++) {
+                if (typeid(*mtrk[off_index]) != typeid(noteoff_message_midi_event))
+                    continue;
+                if (static_cast<const noteoff_message_midi_event&>(*mtrk[off_index]).get_key()
+                        == noteon_ev.get_key())
+                    break;
+            }
+            if (off_index == num_events) {
+                // without a Note OFF the note sounds until the end, and
+                // within the loop also from its start on
+                is_note[ievt] = true;
+                audible_end[ievt] = UINT32_MAX;
+                if (has_loop && ievt > loop_start)
+                    loop_hanging = true;
+                continue;
+            }
+            uint32_t off_tick = mtrk[off_index]->ticks;
+            int frames = vgr_release_frames(voice);
+            uint32_t release_ticks = default_release_ticks;
+            if (frames >= 0) {
+                if (echo_vol > 0)
+                    frames += echo_len * 2;
+                release_ticks = static_cast<uint32_t>(
+                        std::ceil(frames * get_bpm(off_tick) / 150.0));
+            }
+            is_note[ievt] = true;
+            audible_end[ievt] = off_tick + release_ticks;
+            if (vol_init && vol == 0)
+                silent_notes.emplace_back(ievt, off_index);
+        }
+        for (const auto& note : silent_notes) {
+            // the first volume change after the Note ON
+            auto it = std::upper_bound(vol_events.begin(), vol_events.end(), note.first);
+            if (it != vol_events.end() && mtrk[*it]->ticks < audible_end[note.first])
+                continue;
+            dead[note.first] = dead[note.second] = true;
+            is_note[note.first] = false;
+            num_notes += 1;
+        }
+
+        // latest audible end of the notes before each event
+        std::vector<uint32_t> sounding_until(num_events + 1, 0);
+        // next Note ON at or after each event
+        std::vector<size_t> next_note(num_events + 1, num_events);
+        for (size_t ievt = 0; ievt < flow_end; ievt++) {
+            sounding_until[ievt + 1] = sounding_until[ievt];
+            if (is_note[ievt])
+                sounding_until[ievt + 1] = std::max(sounding_until[ievt + 1], audible_end[ievt]);
+            if (ievt == loop_start && loop_hanging)
+                sounding_until[ievt + 1] = UINT32_MAX;
+        }
+        for (size_t ievt = flow_end; ievt-- > 0;) {
+            next_note[ievt] = is_note[ievt] ? ievt : next_note[ievt + 1];
+        }
+
+        std::vector<size_t> last_of_lane(DCE_NUM_LANES, num_events);
+        std::vector<size_t> next_of_lane(flow_end, num_events);
+        std::vector<size_t> first_in_loop(DCE_NUM_LANES, num_events);
+        for (size_t ievt = flow_end; ievt-- > 0;) {
+            dce_lane lane = get_lane(*mtrk[ievt]);
+            if (lane == DCE_NONE)
+                continue;
+            next_of_lane[ievt] = last_of_lane[lane];
+            last_of_lane[lane] = ievt;
+            if (has_loop && ievt >= loop_start)
+                first_in_loop[lane] = ievt;
+        }
+
+        for (size_t ievt = 0; ievt < flow_end; ievt++) {
+            dce_lane lane = get_lane(*mtrk[ievt]);
+            if (lane == DCE_NONE)
+                continue;
+            const uint32_t tick = mtrk[ievt]->ticks;
+            // only Note ONs read these, so sounding notes don't observe them
+            const bool on_note_on = lane >= DCE_VOICE;
+            if (!on_note_on && sounding_until[ievt] > tick)
+                continue;
+            // the first note hearing the event before it's overwritten
+            size_t next = next_of_lane[ievt];
+            size_t observer = next_note[ievt + 1];
+            if (next == num_events) {
+                // flows to the end of the track, or around the loop
+                if (observer >= flow_end)
+                    observer = num_events;
+                if (observer == num_events && has_loop && ievt >= loop_start &&
+                        next_note[loop_start] < first_in_loop[lane])
+                    continue;
+            } else if (observer > next) {
+                observer = num_events;
+            }
+            if (observer == num_events) {
+                mtrk[ievt] = std::make_unique<dummy_midi_event>(tick);
+                num_removed += 1;
+                continue;
+            }
+            // don't move events into or out of the loop
+            if (mtrk[observer]->ticks == tick ||
+                    (ievt < loop_start && observer > loop_start))
+                continue;
+            mtrk[ievt]->ticks = mtrk[observer]->ticks;
+            num_deferred += 1;
+        }
+
+        for (size_t ievt = 0; ievt < num_events; ievt++) {
+            if (ievt > flow_end && get_lane(*mtrk[ievt]) != DCE_NONE) {
+                // never played
+                dead[ievt] = true;
+                num_removed += 1;
+            }
+            if (dead[ievt])
+                mtrk[ievt] = std::make_unique<dummy_midi_event>(mtrk[ievt]->ticks);
+        }
+        // deferred events keep their order before the Note ON
+        std::stable_sort(mtrk.midi_events.begin(), mtrk.midi_events.end(), ev_tick_cmp);
+    }
+    dbg("dead events: removed %zu, deferred %zu, removed %zu silent notes\n",
+            num_removed, num_deferred, num_notes);
+
+    // events around the removed ones may now set values that are already set
+    midi_remove_redundant_events();
+}
+
+/*
+ * midi_trim_notes() : --trim-notes
+ *
+ * Voices with a sustain level of 0 fade out while the note is still held,
+ * but the engine keeps the channel busy until the Note OFF (or until the
+ * envelope reaches 0). Notes are ended as soon as their envelope, scaled by
+ * the velocity, is below arg_trim_level, which frees the channel for other
+ * notes and turns many TIE/EOT pairs into single N?? notes. Notes across a
+ * loop marker and overlapping notes of the same key are left alone.
+ */
+static void midi_trim_notes() {
+    using namespace cppmidi;
+
+    if (arg_trim_level == 0 || mf.midi_tracks.size() == 0)
+        return;
+
+    // tempo events are all located in the first track at this point
+    std::vector<std::pair<uint32_t, double>> tempo_map;
+    for (const std::unique_ptr<midi_event>& ev : mf[0].midi_events) {
+        if (typeid(*ev) == typeid(tempo_meta_midi_event)) {
+            const tempo_meta_midi_event& tev =
+                static_cast<const tempo_meta_midi_event&>(*ev);
+            tempo_map.emplace_back(ev->ticks, tev.get_bpm());
+        }
+    }
+    // the fastest tempo within [from, to], so the note is never cut too early
+    auto get_max_bpm = [&](uint32_t from, uint32_t to) {
+        double bpm = 150.0, max_bpm = 0.0;
+        for (const auto& tempo : tempo_map) {
+            if (tempo.first > to)
+                break;
+            if (tempo.first > from)
+                max_bpm = std::max(max_bpm, bpm);
+            bpm = tempo.second;
+        }
+        return std::max(max_bpm, bpm);
+    };
+    // at the tempo of the tick the time span starts at
+    auto ticks_to_frames = [&](uint32_t from, uint32_t ticks) {
+        return ticks * 150.0 / get_max_bpm(from, from);
+    };
+
+    size_t num_notes = 0, num_trimmed = 0, num_ties = 0;
+    double frames_held = 0.0, frames_saved = 0.0;
+
+    for (midi_track& mtrk : mf.midi_tracks) {
+        const size_t num_events = mtrk.midi_events.size();
+        std::vector<size_t> loop_events;
+        for (size_t ievt = 0; ievt < num_events; ievt++) {
+            const midi_event& ev = *mtrk[ievt];
+            if (typeid(ev) == typeid(controller_message_midi_event) &&
+                    static_cast<const controller_message_midi_event&>(ev).get_controller()
+                    == MIDI_CC_EX_LOOP)
+                loop_events.push_back(ievt);
+        }
+
+        bool trimmed = false;
+        uint8_t voice = 0, echo_vol = 0;
+        for (size_t ievt = 0; ievt < num_events; ievt++) {
+            count(ctr::EVENTS_TRIM);
+            const midi_event& ev = *mtrk[ievt];
+            if (typeid(ev) == typeid(program_message_midi_event)) {
+                voice = static_cast<const program_message_midi_event&>(ev).get_program();
+                continue;
+            }
+            if (typeid(ev) == typeid(controller_message_midi_event)) {
+                const controller_message_midi_event& cev =
+                    static_cast<const controller_message_midi_event&>(ev);
+                if (cev.get_controller() == MIDI_CC_EX_XIECV)
+                    echo_vol = cev.get_value();
+                continue;
+            }
+            // the pseudo echo starts at the Note OFF
+            if (typeid(ev) != typeid(noteon_message_midi_event) || echo_vol > 0)
+                continue;
+            const noteon_message_midi_event& noteon_ev =
+                static_cast<const noteon_message_midi_event&>(ev);
+            size_t off_index = ievt + 1;
+            bool overlaps = false;
+            for (; off_index < num_events; off_index++) {
+                const midi_event& oev = *mtrk[off_index];
+                if (typeid(oev) == typeid(noteon_message_midi_event) &&
+                        static_cast<const noteon_message_midi_event&>(oev).get_key()
+                        == noteon_ev.get_key())
+                    overlaps = true;
+                if (typeid(oev) != typeid(noteoff_message_midi_event))
+                    continue;
+                if (static_cast<const noteoff_message_midi_event&>(oev).get_key()
+                        == noteon_ev.get_key())
+                    break;
+            }
+            if (off_index == num_events)
+                continue;
+
+            const uint32_t on_tick = ev.ticks;
+            const uint32_t off_tick = mtrk[off_index]->ticks;
+            num_notes += 1;
+            frames_held += ticks_to_frames(on_tick, off_tick - on_tick);
+
+            auto loop = std::upper_bound(loop_events.begin(), loop_events.end(), ievt);
+            if (overlaps || (loop != loop_events.end() && *loop < off_index))
+                continue;
+            int frames = vgr_audible_frames(voice, noteon_ev.get_velocity(), arg_trim_level);
+            if (frames < 0)
+                continue;
+            uint32_t audible_ticks = static_cast<uint32_t>(
+                    std::ceil(frames * get_max_bpm(on_tick, off_tick) / 150.0));
+            audible_ticks = std::max(audible_ticks, 1u);
+            if (on_tick + audible_ticks >= off_tick)
+                continue;
+
+            frames_saved += ticks_to_frames(on_tick + audible_ticks,
+                    off_tick - on_tick - audible_ticks);
+            // midi_to_agb() writes notes longer than 96 ticks as TIE
+            if (off_tick - on_tick > 96 && audible_ticks <= 96)
+                num_ties += 1;
+            mtrk[off_index]->ticks = on_tick + audible_ticks;
+            num_trimmed += 1;
+            trimmed = true;
+        }
+        if (trimmed)
+            std::stable_sort(mtrk.midi_events.begin(), mtrk.midi_events.end(), ev_tick_cmp);
+    }
+
+    err("note trimming: %zu of %zu notes shortened, %zu TIE notes became N notes, "
+            "%.1f of %.1f channel seconds saved\n", num_trimmed, num_notes, num_ties,
+            frames_saved / 60.0, frames_held / 60.0);
+}
+
 struct bar {
     bar(uint32_t start_tick, uint32_t num_ticks)
         : start_tick(start_tick), num_ticks(num_ticks) {}
@@ -1209,7 +3551,174 @@ struct bar {
     uint32_t num_ticks;
 };
 
-static void midi_to_agb() {
+// identifies an event regardless of its tick, 0 for events to ignore
+static size_t midi_event_content_hash(const cppmidi::midi_event& ev) {
+    using namespace cppmidi;
+
+    if (typeid(ev) == typeid(noteon_message_midi_event)) {
+        const noteon_message_midi_event& nev =
+            static_cast<const noteon_message_midi_event&>(ev);
+        return 0x100000u | static_cast<size_t>(nev.get_key() << 8) | nev.get_velocity();
+    } else if (typeid(ev) == typeid(noteoff_message_midi_event)) {
+        const noteoff_message_midi_event& nev =
+            static_cast<const noteoff_message_midi_event&>(ev);
+        return 0x200000u | nev.get_key();
+    } else if (typeid(ev) == typeid(controller_message_midi_event)) {
+        const controller_message_midi_event& cev =
+            static_cast<const controller_message_midi_event&>(ev);
+        return 0x300000u | static_cast<size_t>(cev.get_controller() << 8) | cev.get_value();
+    } else if (typeid(ev) == typeid(program_message_midi_event)) {
+        const program_message_midi_event& pev =
+            static_cast<const program_message_midi_event&>(ev);
+        return 0x400000u | pev.get_program();
+    } else if (typeid(ev) == typeid(pitchbend_message_midi_event)) {
+        const pitchbend_message_midi_event& pev =
+            static_cast<const pitchbend_message_midi_event&>(ev);
+        return 0x500000u | static_cast<uint16_t>(pev.get_pitch());
+    }
+    // meta events only appear in the first track and don't repeat anyway
+    return 0;
+}
+
+/*
+ * midi_estimate_size() : rough song size for a bar table
+ *
+ * Notes take 3 bytes, other events 2 and every wait 1. A bar which occured
+ * before costs 5 bytes for the PATT instead, if that is smaller. Bars with
+ * a loop point can't be patterns.
+ */
+static size_t midi_estimate_size(const std::vector<bar>& bar_table) {
+    using namespace cppmidi;
+
+    std::unordered_set<size_t> seen;
+    size_t size = 0;
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        size_t ibar = 0;
+        size_t hash = bar_table[0].num_ticks;
+        size_t bar_size = 0;
+        bool has_loop = false;
+        uint32_t last_tick = 0;
+        auto end_bar = [&]() {
+            if (bar_size > 5 && !has_loop && !seen.insert(hash).second)
+                size += 5;
+            else
+                size += bar_size;
+            bar_size = 0;
+            has_loop = false;
+            hash = bar_table[ibar].num_ticks;
+            last_tick = bar_table[ibar].start_tick;
+        };
+        for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+            while (ibar + 1 < bar_table.size() && ev->ticks >= bar_table[ibar + 1].start_tick) {
+                // wait until the end of the bar
+                bar_size += 1;
+                ibar++;
+                end_bar();
+            }
+            size_t h = midi_event_content_hash(*ev);
+            if (h == 0)
+                continue;
+            if (ev->ticks != last_tick) {
+                bar_size += 1;
+                last_tick = ev->ticks;
+            }
+            if (typeid(*ev) == typeid(noteon_message_midi_event)) {
+                bar_size += 3;
+            } else if (typeid(*ev) == typeid(controller_message_midi_event) &&
+                    static_cast<const controller_message_midi_event&>(*ev).get_controller()
+                    == MIDI_CC_EX_LOOP) {
+                has_loop = true;
+            } else if (typeid(*ev) != typeid(noteoff_message_midi_event)) {
+                bar_size += 2;
+            }
+            h ^= static_cast<size_t>(ev->ticks - bar_table[ibar].start_tick) << 24;
+            hash = hash * 0x100000001B3ull + h;
+        }
+        end_bar();
+    }
+    return size;
+}
+
+static std::vector<bar> midi_make_bar_table(uint32_t len, uint32_t phase, uint32_t end) {
+    std::vector<bar> bar_table;
+    if (phase > 0)
+        bar_table.emplace_back(0, phase);
+    for (uint32_t tick = phase; tick <= end; tick += len)
+        bar_table.emplace_back(tick, len);
+    return bar_table;
+}
+
+/*
+ * midi_infer_bars() : finds the bar length and phase from the notes
+ *
+ * Exported MIDIs often have missing or wrong time signatures. Then bars
+ * are cut at the wrong ticks and hardly any of them repeat. The
+ * autocorrelation of the note onsets shows the periods at which the song
+ * repeats. For the strongest ones every phase (in 16th steps) is tried,
+ * and the bar table with the smallest estimated size is used if it beats
+ * the one from the time signatures.
+ */
+static bool midi_infer_bars(std::vector<bar>& bar_table) {
+    using namespace cppmidi;
+
+    uint32_t end = 0;
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        if (mtrk.midi_events.size() > 0)
+            end = std::max(end, mtrk.midi_events.back()->ticks);
+    }
+
+    std::vector<float> onsets(end + 1, 0.0f);
+    size_t num_onsets = 0;
+    for (const midi_track& mtrk : mf.midi_tracks) {
+        for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+            if (typeid(*ev) != typeid(noteon_message_midi_event))
+                continue;
+            const noteon_message_midi_event& nev =
+                static_cast<const noteon_message_midi_event&>(*ev);
+            onsets[ev->ticks] += nev.get_velocity() / 127.0f;
+            num_onsets += 1;
+        }
+    }
+    if (num_onsets == 0)
+        return false;
+
+    // bar lengths from a quarter to two whole notes, in 16th steps
+    std::vector<std::pair<double, uint32_t>> periods;
+    for (uint32_t len = 24; len <= 192 && len < end; len += 6) {
+        double r = 0.0;
+        for (uint32_t t = 0; t + len <= end; t++)
+            r += onsets[t] * onsets[t + len];
+        periods.emplace_back(r / (end + 1 - len), len);
+    }
+    std::sort(periods.begin(), periods.end(), std::greater<>());
+    periods.resize(std::min<size_t>(periods.size(), 4));
+
+    size_t best_size = midi_estimate_size(bar_table);
+    const size_t timesig_size = best_size;
+    uint32_t best_len = 0, best_phase = 0;
+    for (const auto& period : periods) {
+        uint32_t len = period.second;
+        for (uint32_t phase = 0; phase < len; phase += 6) {
+            size_t size = midi_estimate_size(midi_make_bar_table(len, phase, end));
+            if (size < best_size) {
+                best_size = size;
+                best_len = len;
+                best_phase = phase;
+            }
+        }
+    }
+
+    if (best_len == 0) {
+        dbg("bar inference: time signatures kept (estimated %zu bytes)\n", timesig_size);
+        return false;
+    }
+    dbg("bar inference: trying %u ticks per bar starting at tick %u (estimated %zu "
+            "instead of %zu bytes)\n", best_len, best_phase, best_size, timesig_size);
+    bar_table = midi_make_bar_table(best_len, best_phase, end);
+    return true;
+}
+
+static bool midi_to_agb(bool infer_bars) {
     using namespace cppmidi;
 
     // create bar table
@@ -1218,7 +3727,7 @@ static void midi_to_agb() {
 
     bar_table.emplace_back(0, 0);
     if (mf.midi_tracks.size() == 0)
-        return;
+        return false;
     const midi_track& mtrk = mf[0];
 
     uint32_t prev_tick = 0;
@@ -1253,6 +3762,9 @@ static void midi_to_agb() {
     // last bar is always fully extended incase of missing events.
     bar_table.back().num_ticks = current_bar_len;
 
+    if (infer_bars && !midi_infer_bars(bar_table))
+        return false;
+
     // convert to agb events
     assert(as.tracks.size() == 0);
 
@@ -1267,7 +3779,9 @@ static void midi_to_agb() {
             static_cast<const noteon_message_midi_event&>(*mtrk[noteon_index]);
         size_t i = noteon_index;
         uint8_t key = noteon_ev.get_key();
+        count(ctr::NOTE_LENGTH_CALLS);
         while (1) {
+            count(ctr::NOTE_LENGTH_STEPS);
             i += 1;
             if (i >= mtrk.midi_events.size())
                 return false;
@@ -1292,7 +3806,9 @@ static void midi_to_agb() {
 
         uint32_t current_bar = 0;
         uint32_t tick_counter = 0;
+        bool no_pattern = false;
         for (size_t ievt = 0; ievt < mtrk.midi_events.size(); ievt++) {
+            count(ctr::EVENTS_TO_AGB);
             const midi_event& ev = *mtrk[ievt];
             // skip all dummy events EXCEPT the very last one
             // so the song does not get truncated
@@ -1318,6 +3834,7 @@ static void midi_to_agb() {
                     add_wait_event(atrk.bars.back(),
                             bar_table[current_bar].num_ticks - tick_counter);
                     atrk.bars.emplace_back();
+                    atrk.bars.back().no_pattern = no_pattern;
                     tick_counter = 0;
                     current_bar += 1;
                     assert(current_bar < bar_table.size());
@@ -1381,6 +3898,23 @@ static void midi_to_agb() {
                     atrk.bars.back().events.back().tune =
                         static_cast<int8_t>(cev.get_value() - 64);
                     break;
+                case MIDI_CC_EX_XIECV:
+                    atrk.bars.back().events.emplace_back(agb_ev::ty::XCMD);
+                    atrk.bars.back().events.back().xcmd.type = AGB_XCMD_XIECV;
+                    atrk.bars.back().events.back().xcmd.par =
+                        static_cast<uint8_t>(cev.get_value() * 2);
+                    break;
+                case MIDI_CC_EX_XIECL:
+                    atrk.bars.back().events.emplace_back(agb_ev::ty::XCMD);
+                    atrk.bars.back().events.back().xcmd.type = AGB_XCMD_XIECL;
+                    atrk.bars.back().events.back().xcmd.par =
+                        static_cast<uint8_t>(cev.get_value() * 2);
+                    break;
+                case MIDI_CC_EX_NOPATT:
+                    no_pattern = cev.get_value() != 0;
+                    if (no_pattern)
+                        atrk.bars.back().no_pattern = true;
+                    break;
                 default: ;
                 }
             } else if (typeid(ev) == typeid(tempo_meta_midi_event)) {
@@ -1450,6 +3984,7 @@ static void midi_to_agb() {
             }
         }
     }
+    return true;
 }
 
 /*
@@ -1461,38 +3996,986 @@ static void midi_to_agb() {
  * and will process the events in that exact order and so we have to
  * do some prevention here. Otherwise unnecessary notes might get
  * dropped.
+ *
+ * Besides that, the events of each tick are brought into one canonical
+ * order: EOTs, TEMPO, the other commands and then the notes, so ticks with
+ * the same content become identical for the pattern detection. The notes
+ * keep their order since it decides the channel allocation: only the last
+ * note of a chord keeps a PSG channel and stealing between notes of the
+ * same priority depends on it. If commands follow a note on the same tick
+ * (e.g. a VOICE or echo change between two notes), they belong to that
+ * note and only the EOTs are moved.
  */
-static void agb_optimize() {
-    for (agb_track& atrk : as.tracks) {
+static int agb_tick_rank(const agb_ev& ev) {
+    switch (ev.type) {
+    case agb_ev::ty::EOT: return 0;
+    case agb_ev::ty::TEMPO: return 1;
+    case agb_ev::ty::TIE:
+    case agb_ev::ty::NOTE: return 3;
+    default: return 2;
+    }
+}
+
+static void agb_canonicalize_tick(std::vector<agb_ev>& events, size_t begin,
+        size_t end, std::vector<agb_ev>& scratch) {
+    if (end - begin < 2)
+        return;
+
+    bool seen_note = false, interleaved = false;
+    for (size_t ievt = begin; ievt < end; ievt++) {
+        count(ctr::EVENTS_OPTIMIZE);
+        int rank = agb_tick_rank(events[ievt]);
+        if (rank == 3)
+            seen_note = true;
+        else if (rank > 0 && seen_note)
+            interleaved = true;
+    }
+
+    // stable bucket sort by rank, only EOTs for interleaved ticks
+    scratch.clear();
+    const int num_ranks = interleaved ? 1 : 4;
+    for (int rank = 0; rank < num_ranks; rank++) {
+        for (size_t ievt = begin; ievt < end; ievt++) {
+            if (agb_tick_rank(events[ievt]) == rank)
+                scratch.push_back(events[ievt]);
+        }
+    }
+    if (interleaved) {
+        for (size_t ievt = begin; ievt < end; ievt++) {
+            if (agb_tick_rank(events[ievt]) != 0)
+                scratch.push_back(events[ievt]);
+        }
+    }
+    std::copy(scratch.begin(), scratch.end(), events.begin() + static_cast<long>(begin));
+}
+
+static void agb_optimize() {
+    std::vector<agb_ev> scratch;
+    for (agb_track& atrk : as.tracks) {
         for (agb_bar& abar : atrk.bars) {
+            // waits and loop labels separate the ticks
             size_t first_ev_at_tick = 0;
-            for (size_t ievt = 0; ievt < abar.events.size(); ievt++) {
-                if (abar.events[ievt].type == agb_ev::ty::WAIT) {
-                    first_ev_at_tick = ievt + 1;
-                } else if (abar.events[ievt].type == agb_ev::ty::EOT) {
-                    size_t events_to_shift = ievt - first_ev_at_tick;
-                    if (events_to_shift == 0) {
-                        first_ev_at_tick = ievt + 1;
+            for (size_t ievt = 0; ievt <= abar.events.size(); ievt++) {
+                if (ievt < abar.events.size()) {
+                    agb_ev::ty type = abar.events[ievt].type;
+                    if (type != agb_ev::ty::WAIT && type != agb_ev::ty::LOOP_START &&
+                            type != agb_ev::ty::LOOP_END)
                         continue;
+                }
+                agb_canonicalize_tick(abar.events, first_ev_at_tick, ievt, scratch);
+                first_ev_at_tick = ievt + 1;
+            }
+        }
+    }
+}
+
+/*
+ * Voicegroup definition:
+ *
+ * The engine allocates channels differently depending on the voice type.
+ * DirectSound voices share the software mixed channels, each of the PSG
+ * voice types can only play on its dedicated hardware channel.
+ * The definition is either read from the voicegroup's assembly source
+ * (one voice_* macro per program) or from a mapping file with lines like
+ * "<program> <ds|sq1|sq2|wave|noise|keysplit|empty> [<a> <d> <s> <r>]".
+ * Programs the definition doesn't mention are UNKNOWN, not EMPTY.
+ */
+enum class voice_type {
+    UNKNOWN, EMPTY, DIRECTSOUND, SQUARE1, SQUARE2, WAVE, NOISE, KEYSPLIT,
+};
+
+struct voice_def {
+    voice_def() : type(voice_type::UNKNOWN), attack(0xFF), decay(0),
+        sustain(0xFF), release(0) {}
+    voice_type type;
+    uint8_t attack, decay, sustain, release;
+    bool is_psg() const {
+        return type == voice_type::SQUARE1 || type == voice_type::SQUARE2 ||
+            type == voice_type::WAVE || type == voice_type::NOISE;
+    }
+};
+
+static std::vector<voice_def> vgr_def;
+
+static std::vector<std::string> vgr_def_tokenize(const std::string& line) {
+    std::vector<std::string> tokens;
+    std::string tok;
+    for (char c : line) {
+        if (c == '@' || c == '#' || c == ';')
+            break;
+        if (c == ' ' || c == '\t' || c == ',' || c == '\r') {
+            if (tok.size() > 0)
+                tokens.emplace_back(std::move(tok));
+            tok.clear();
+        } else {
+            tok += c;
+        }
+    }
+    if (tok.size() > 0)
+        tokens.emplace_back(std::move(tok));
+    return tokens;
+}
+
+static void vgr_def_load(const std::filesystem::path& path) {
+    std::ifstream fin(path);
+    if (!fin.is_open())
+        die("Unable to open voicegroup definition: %s\n", strerror(errno));
+
+    vgr_def.assign(128, voice_def());
+
+    auto adsr = [](voice_def& v, const std::vector<std::string>& tokens, size_t i) {
+        if (tokens.size() < i + 4)
+            return;
+        v.attack = static_cast<uint8_t>(std::clamp(std::stoi(tokens[i + 0], nullptr, 0), 0, 255));
+        v.decay = static_cast<uint8_t>(std::clamp(std::stoi(tokens[i + 1], nullptr, 0), 0, 255));
+        v.sustain = static_cast<uint8_t>(std::clamp(std::stoi(tokens[i + 2], nullptr, 0), 0, 255));
+        v.release = static_cast<uint8_t>(std::clamp(std::stoi(tokens[i + 3], nullptr, 0), 0, 255));
+    };
+
+    size_t asm_slot = 0;
+    std::string line;
+    while (std::getline(fin, line)) {
+        std::vector<std::string> tokens = vgr_def_tokenize(line);
+        if (tokens.size() == 0)
+            continue;
+        const std::string& macro = tokens[0];
+        if (!macro.compare(0, 6, "voice_")) {
+            // assembly: one voice per macro in program order
+            if (asm_slot >= vgr_def.size())
+                die("voicegroup definition: more than 128 voices\n");
+            voice_def& v = vgr_def[asm_slot++];
+            if (!macro.compare(0, 14, "voice_keysplit")) {
+                v.type = voice_type::KEYSPLIT;
+            } else if (!macro.compare(0, 17, "voice_directsound")) {
+                v.type = voice_type::DIRECTSOUND;
+                // a null sample is used for unused slots
+                if (tokens.size() > 3 && (!tokens[3].compare("0") || !tokens[3].compare("NULL")))
+                    v.type = voice_type::EMPTY;
+                adsr(v, tokens, 4);
+            } else if (!macro.compare(0, 14, "voice_square_1")) {
+                v.type = voice_type::SQUARE1;
+                adsr(v, tokens, 5);
+            } else if (!macro.compare(0, 14, "voice_square_2")) {
+                v.type = voice_type::SQUARE2;
+                adsr(v, tokens, 4);
+            } else if (!macro.compare(0, 23, "voice_programmable_wave")) {
+                v.type = voice_type::WAVE;
+                adsr(v, tokens, 4);
+            } else if (!macro.compare(0, 11, "voice_noise")) {
+                v.type = voice_type::NOISE;
+                adsr(v, tokens, 4);
+            } else {
+                dbg("voicegroup definition: unknown voice macro %s\n", macro.c_str());
+            }
+        } else if (macro[0] >= '0' && macro[0] <= '9' && tokens.size() >= 2) {
+            // mapping file: explicit program number
+            int prog = std::stoi(macro, nullptr, 0);
+            if (prog < 0 || prog > 127)
+                die("voicegroup definition: program %d out of range\n", prog);
+            voice_def& v = vgr_def[static_cast<size_t>(prog)];
+            const std::string& type = tokens[1];
+            if (!type.compare("ds") || !type.compare("directsound"))
+                v.type = voice_type::DIRECTSOUND;
+            else if (!type.compare("sq1") || !type.compare("square1"))
+                v.type = voice_type::SQUARE1;
+            else if (!type.compare("sq2") || !type.compare("square2"))
+                v.type = voice_type::SQUARE2;
+            else if (!type.compare("wave"))
+                v.type = voice_type::WAVE;
+            else if (!type.compare("noise"))
+                v.type = voice_type::NOISE;
+            else if (!type.compare("keysplit"))
+                v.type = voice_type::KEYSPLIT;
+            else if (!type.compare("empty"))
+                v.type = voice_type::EMPTY;
+            else
+                die("voicegroup definition: unknown voice type %s\n", type.c_str());
+            adsr(v, tokens, 2);
+        }
+        // everything else (labels, directives) is ignored
+    }
+}
+
+// frames until a released note of the voice is inaudible, -1 if unknown
+static int vgr_release_frames(uint8_t voice) {
+    if (vgr_def.empty())
+        return -1;
+    const voice_def& v = vgr_def[voice & 0x7F];
+    if (v.type == voice_type::EMPTY)
+        return 0;
+    if (v.type == voice_type::KEYSPLIT || v.type == voice_type::UNKNOWN)
+        return -1;
+    if (v.is_psg()) {
+        // one of 15 envelope steps every 'release' frames
+        return v.release * 15;
+    }
+    // the envelope is multiplied by release/256 every frame, count until it
+    // falls below 8 (of 255)
+    if (v.release == 0)
+        return 1;
+    return static_cast<int>(std::ceil(std::log(8.0 / 255.0) / std::log(v.release / 256.0)));
+}
+
+/*
+ * frames until a held note of the voice is quieter than level (of 255)
+ * while the note is still held, -1 if it stays audible or is unknown
+ */
+static int vgr_audible_frames(uint8_t voice, uint8_t vel, uint8_t level) {
+    if (vgr_def.empty())
+        return -1;
+    const voice_def& v = vgr_def[voice & 0x7F];
+    auto audible = [&](int env) { return env * vel / 127 >= level; };
+    if (v.is_psg()) {
+        // 15 envelope steps, one every 'attack' or 'decay' frames
+        if (v.decay == 0 || audible((v.sustain & 0xF) * 17))
+            return -1;
+        int step = 15;
+        while (step > 0 && audible(step * 17))
+            step--;
+        return v.attack * 15 + v.decay * (15 - step);
+    }
+    if (v.type != voice_type::DIRECTSOUND || v.attack == 0 || audible(v.sustain))
+        return -1;
+    // attack adds 'attack' every frame, decay multiplies by decay/256
+    int frames = 0, env = 0;
+    while (env < 255) {
+        env = std::min(env + v.attack, 255);
+        frames++;
+    }
+    while (audible(env)) {
+        env = env * v.decay >> 8;
+        frames++;
+    }
+    return frames;
+}
+
+/*
+ * Flattened view of a track: all non wait events with their absolute tick
+ * and the bar they're located in. Patterns are already expanded in
+ * agb_song, loops are not.
+ */
+struct agb_timed_ev {
+    agb_timed_ev(uint32_t tick, size_t bar, const agb_ev& ev)
+        : tick(tick), bar(bar), ev(ev) {}
+    uint32_t tick;
+    size_t bar;
+    std::reference_wrapper<const agb_ev> ev;
+};
+
+static std::vector<agb_timed_ev> agb_track_timeline(const agb_track& atrk) {
+    std::vector<agb_timed_ev> timeline;
+    uint32_t tick = 0;
+    for (size_t ibar = 0; ibar < atrk.bars.size(); ibar++) {
+        for (const agb_ev& ev : atrk.bars[ibar].events) {
+            if (ev.type == agb_ev::ty::WAIT)
+                tick += ev.wait;
+            else
+                timeline.emplace_back(tick, ibar, ev);
+        }
+    }
+    return timeline;
+}
+
+static void agb_merge_waits(agb_bar& abar) {
+    size_t iout = 0;
+    for (size_t ievt = 0; ievt < abar.events.size(); ievt++) {
+        if (iout > 0 && abar.events[ievt].type == agb_ev::ty::WAIT &&
+                abar.events[iout - 1].type == agb_ev::ty::WAIT) {
+            abar.events[iout - 1].wait += abar.events[ievt].wait;
+            continue;
+        }
+        abar.events[iout++] = abar.events[ievt];
+    }
+    abar.events.resize(iout, agb_ev(agb_ev::ty::WAIT));
+}
+
+/*
+ * Notes on empty voicegroup slots don't produce any sound but still
+ * take up space and make the engine allocate (and possibly steal) channels.
+ */
+static void agb_strip_empty_voices() {
+    if (!arg_strip_empty)
+        return;
+
+    size_t num_removed = 0;
+    for (agb_track& atrk : as.tracks) {
+        uint8_t voice = 0;
+        std::vector<bool> tie_on_empty(128, false);
+        for (agb_bar& abar : atrk.bars) {
+            size_t size_before = abar.events.size();
+            abar.events.erase(std::remove_if(abar.events.begin(), abar.events.end(),
+                        [&](const agb_ev& ev) {
+                if (ev.type == agb_ev::ty::VOICE) {
+                    voice = ev.voice;
+                } else if (ev.type == agb_ev::ty::NOTE) {
+                    return vgr_def[voice & 0x7F].type == voice_type::EMPTY;
+                } else if (ev.type == agb_ev::ty::TIE) {
+                    bool empty = vgr_def[voice & 0x7F].type == voice_type::EMPTY;
+                    tie_on_empty[ev.tie.key & 0x7F] = empty;
+                    return empty;
+                } else if (ev.type == agb_ev::ty::EOT) {
+                    bool empty = tie_on_empty[ev.eot.key & 0x7F];
+                    tie_on_empty[ev.eot.key & 0x7F] = false;
+                    return empty;
+                }
+                return false;
+            }), abar.events.end());
+            if (abar.events.size() != size_before) {
+                num_removed += size_before - abar.events.size();
+                agb_merge_waits(abar);
+            }
+        }
+    }
+    dbg("removed %zu events on empty voices\n", num_removed);
+}
+
+/*
+ * agb_simulate_channels() :
+ *
+ * Plays the converted song through a model of the engine's channel
+ * allocator. DirectSound notes get any of the --ds-chn channels, PSG notes
+ * only their dedicated channel. If no channel is free, the engine steals
+ * the channel with the lowest priority (for equal priority the one of the
+ * highest track number) as long as it is not more important than the new
+ * note. Otherwise the new note is dropped. Releasing of notes is not
+ * modelled, a channel is considered free as soon as the note ends.
+ */
+struct sim_channel {
+    sim_channel() : active(false), track(0), key(0), prio(0), end(0) {}
+    bool active;
+    size_t track;
+    uint8_t key, prio;
+    uint32_t end;
+};
+
+struct sim_result {
+    sim_result() : num_notes(0), num_stolen(0), num_dropped(0) {}
+    size_t num_notes, num_stolen, num_dropped;
+    // ticks at which a note was stolen or dropped
+    std::vector<uint32_t> lost_ticks;
+};
+
+static sim_result agb_run_channel_sim(bool report) {
+    static const uint32_t TIE_OPEN = 0xFFFFFFFF;
+
+    struct sim_track {
+        std::vector<agb_timed_ev> timeline;
+        size_t pos = 0;
+        uint8_t voice = 0;
+        uint8_t prio = 0;
+    };
+
+    std::vector<sim_track> tracks(as.tracks.size());
+    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++)
+        tracks[itrk].timeline = agb_track_timeline(as.tracks[itrk]);
+
+    std::vector<sim_channel> ds_channels(arg_ds_channels);
+    // PSG: square 1, square 2, wave, noise
+    std::vector<sim_channel> psg_channels(4);
+
+    sim_result result;
+
+    auto release = [](std::vector<sim_channel>& channels, uint32_t tick) {
+        for (sim_channel& chn : channels) {
+            if (chn.active && chn.end <= tick)
+                chn.active = false;
+        }
+    };
+
+    auto lost = [&](const char *what, size_t itrk, uint8_t key, uint32_t tick,
+            size_t ibar) {
+        result.lost_ticks.push_back(tick);
+        if (report)
+            err("tick %6u (bar %3zu): %s note %3d on track %zu\n",
+                    tick, ibar, what, key, itrk);
+    };
+
+    // try to get a channel out of candidates
+    auto allocate = [&](sim_channel *candidates, size_t num_candidates,
+            size_t itrk, uint8_t key, uint8_t prio, uint32_t tick,
+            uint32_t end, size_t ibar) {
+        result.num_notes += 1;
+        sim_channel *victim = nullptr;
+        for (size_t i = 0; i < num_candidates; i++) {
+            sim_channel& chn = candidates[i];
+            if (!chn.active) {
+                victim = &chn;
+                break;
+            }
+            if (!victim || chn.prio < victim->prio ||
+                    (chn.prio == victim->prio && chn.track > victim->track))
+                victim = &chn;
+        }
+        if (victim->active) {
+            if (victim->prio > prio || (victim->prio == prio && victim->track < itrk)) {
+                result.num_dropped += 1;
+                lost("dropped", itrk, key, tick, ibar);
+                return;
+            }
+            result.num_stolen += 1;
+            lost("stolen ", victim->track, victim->key, tick, ibar);
+        }
+        victim->active = true;
+        victim->track = itrk;
+        victim->key = key;
+        victim->prio = prio;
+        victim->end = end;
+    };
+
+    while (1) {
+        // find the next tick any track has an event on
+        uint32_t tick = TIE_OPEN;
+        for (const sim_track& strk : tracks) {
+            if (strk.pos < strk.timeline.size())
+                tick = std::min(tick, strk.timeline[strk.pos].tick);
+        }
+        if (tick == TIE_OPEN)
+            break;
+
+        release(ds_channels, tick);
+        release(psg_channels, tick);
+
+        // the engine processes the tracks in order
+        for (size_t itrk = 0; itrk < tracks.size(); itrk++) {
+            sim_track& strk = tracks[itrk];
+            while (strk.pos < strk.timeline.size() &&
+                    strk.timeline[strk.pos].tick == tick) {
+                const agb_ev& ev = strk.timeline[strk.pos].ev;
+                size_t ibar = strk.timeline[strk.pos].bar;
+                strk.pos += 1;
+                uint8_t key;
+                uint32_t end;
+                if (ev.type == agb_ev::ty::VOICE) {
+                    strk.voice = ev.voice;
+                    continue;
+                } else if (ev.type == agb_ev::ty::PRIO) {
+                    strk.prio = ev.prio;
+                    continue;
+                } else if (ev.type == agb_ev::ty::EOT) {
+                    for (sim_channel& chn : ds_channels) {
+                        if (chn.active && chn.track == itrk && chn.key == ev.eot.key &&
+                                chn.end == TIE_OPEN)
+                            chn.active = false;
                     }
-                    agb_ev eot_event(std::move(abar.events[ievt]));
-                    std::vector<agb_ev> events_removed(
-                            std::make_move_iterator(abar.events.begin() +
-                                first_ev_at_tick),
-                            std::make_move_iterator(abar.events.begin() +
-                                static_cast<long>(first_ev_at_tick + events_to_shift)));
-                    abar.events[first_ev_at_tick] = std::move(eot_event);
-                    std::move(events_removed.begin(), events_removed.end(),
-                            abar.events.begin() + static_cast<long>(first_ev_at_tick + 1));
-
-                    first_ev_at_tick += 1;
+                    for (sim_channel& chn : psg_channels) {
+                        if (chn.active && chn.track == itrk && chn.key == ev.eot.key &&
+                                chn.end == TIE_OPEN)
+                            chn.active = false;
+                    }
+                    continue;
+                } else if (ev.type == agb_ev::ty::NOTE) {
+                    key = ev.note.key;
+                    end = tick + ev.note.len;
+                } else if (ev.type == agb_ev::ty::TIE) {
+                    key = ev.tie.key;
+                    end = TIE_OPEN;
+                } else {
+                    continue;
+                }
+
+                switch (vgr_def[strk.voice & 0x7F].type) {
+                case voice_type::EMPTY:
+                    break;
+                case voice_type::UNKNOWN:
+                case voice_type::DIRECTSOUND:
+                case voice_type::KEYSPLIT:
+                    // key splits mostly consist of DirectSound voices and
+                    // so do the voices the definition doesn't list
+                    allocate(ds_channels.data(), ds_channels.size(),
+                            itrk, key, strk.prio, tick, end, ibar);
+                    break;
+                case voice_type::SQUARE1:
+                    allocate(&psg_channels[0], 1, itrk, key, strk.prio, tick, end, ibar);
+                    break;
+                case voice_type::SQUARE2:
+                    allocate(&psg_channels[1], 1, itrk, key, strk.prio, tick, end, ibar);
+                    break;
+                case voice_type::WAVE:
+                    allocate(&psg_channels[2], 1, itrk, key, strk.prio, tick, end, ibar);
+                    break;
+                case voice_type::NOISE:
+                    allocate(&psg_channels[3], 1, itrk, key, strk.prio, tick, end, ibar);
+                    break;
                 }
             }
         }
     }
+    return result;
+}
+
+static void agb_simulate_channels() {
+    if (!arg_simulate)
+        return;
+
+    sim_result result = agb_run_channel_sim(true);
+    err("channel simulation: %zu notes, %zu stolen, %zu dropped (%d DirectSound channels)\n",
+            result.num_notes, result.num_stolen, result.num_dropped, arg_ds_channels);
+}
+
+/*
+ * agb_auto_prio() :
+ *
+ * If the channel simulation loses notes, the engine's stealing will drop
+ * whatever happens to have the lowest priority, which with all tracks on
+ * the same priority is the note of the highest track number. In order to
+ * make it drop the least important voices instead, this ranks the tracks
+ * by salience and gives every track which sounds while notes are lost its
+ * own priority. Tracks with an explicit "prio=" are left untouched.
+ *
+ * Salience favours melodic (mostly monophonic, higher pitched) tracks,
+ * loud tracks and tracks with a lot of notes over pads with long notes.
+ */
+static void agb_auto_prio() {
+    if (!arg_auto_prio)
+        return;
+
+    sim_result before = agb_run_channel_sim(false);
+    if (before.lost_ticks.size() == 0)
+        return;
+
+    struct track_info {
+        double salience = 0.0;
+        bool has_prio = false;
+        bool overloaded = false;
+        size_t num_notes = 0;
+    };
+    std::vector<track_info> infos(as.tracks.size());
+
+    uint32_t song_len = 1;
+    double max_density = 0.0;
+    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
+        track_info& info = infos[itrk];
+        std::vector<agb_timed_ev> timeline = agb_track_timeline(as.tracks[itrk]);
+        std::vector<std::pair<uint32_t, uint32_t>> notes;
+        std::vector<uint32_t> tie_start(128, 0);
+        double vel_sum = 0.0, key_sum = 0.0;
+        for (const agb_timed_ev& tev : timeline) {
+            const agb_ev& ev = tev.ev;
+            if (ev.type == agb_ev::ty::PRIO) {
+                info.has_prio = true;
+            } else if (ev.type == agb_ev::ty::NOTE) {
+                notes.emplace_back(tev.tick, tev.tick + ev.note.len);
+                vel_sum += ev.note.vel;
+                key_sum += ev.note.key;
+            } else if (ev.type == agb_ev::ty::TIE) {
+                tie_start[ev.tie.key & 0x7F] = tev.tick;
+                vel_sum += ev.tie.vel;
+                key_sum += ev.tie.key;
+            } else if (ev.type == agb_ev::ty::EOT) {
+                notes.emplace_back(tie_start[ev.eot.key & 0x7F], tev.tick);
+            }
+            song_len = std::max(song_len, tev.tick);
+        }
+        info.num_notes = notes.size();
+        if (notes.size() == 0)
+            continue;
+
+        // monophony: fraction of notes not overlapping with the next one
+        std::sort(notes.begin(), notes.end());
+        size_t num_mono = 0;
+        double len_sum = 0.0;
+        for (size_t i = 0; i < notes.size(); i++) {
+            if (i + 1 == notes.size() || notes[i + 1].first >= notes[i].second)
+                num_mono += 1;
+            len_sum += notes[i].second - notes[i].first;
+        }
+        double mono = static_cast<double>(num_mono) / static_cast<double>(notes.size());
+        double pitch = key_sum / static_cast<double>(notes.size()) / 127.0;
+        double vel = vel_sum / static_cast<double>(notes.size()) / 127.0;
+        double avg_len = len_sum / static_cast<double>(notes.size());
+        double pad = std::min(avg_len / 96.0, 1.0);
+        info.salience = 0.35 * mono * (0.5 + pitch) + 0.3 * vel - 0.2 * pad;
+
+        // only tracks sounding while notes are lost need a priority
+        for (uint32_t lost_tick : before.lost_ticks) {
+            for (const auto& note : notes) {
+                if (note.first <= lost_tick && lost_tick < note.second) {
+                    info.overloaded = true;
+                    break;
+                }
+            }
+            if (info.overloaded)
+                break;
+        }
+    }
+    for (const track_info& info : infos) {
+        max_density = std::max(max_density,
+                static_cast<double>(info.num_notes) / song_len);
+    }
+    for (track_info& info : infos) {
+        if (max_density > 0.0)
+            info.salience += 0.35 * static_cast<double>(info.num_notes) / song_len / max_density;
+    }
+
+    // the most salient track gets the highest priority
+    std::vector<size_t> ranking;
+    for (size_t itrk = 0; itrk < infos.size(); itrk++) {
+        if (!infos[itrk].has_prio && infos[itrk].overloaded)
+            ranking.push_back(itrk);
+    }
+    std::stable_sort(ranking.begin(), ranking.end(), [&](size_t a, size_t b) {
+        return infos[a].salience < infos[b].salience;
+    });
+
+    for (size_t irank = 0; irank < ranking.size(); irank++) {
+        agb_track& atrk = as.tracks[ranking[irank]];
+        if (atrk.bars.size() == 0)
+            continue;
+        agb_ev prio_ev(agb_ev::ty::PRIO);
+        prio_ev.prio = static_cast<uint8_t>(std::min(irank + 1, size_t(127)));
+        atrk.bars[0].events.insert(atrk.bars[0].events.begin(), prio_ev);
+        dbg("auto prio: track %zu salience %.3f -> PRIO %d\n", ranking[irank],
+                infos[ranking[irank]].salience, prio_ev.prio);
+    }
+
+    sim_result after = agb_run_channel_sim(false);
+    dbg("auto prio: lost notes %zu -> %zu\n", before.lost_ticks.size(),
+            after.lost_ticks.size());
+}
+
+/*
+ * agb_emit_midi() : writes the final song back to a MIDI file
+ *
+ * This is meant for listening to the result of the lossy passes without
+ * building a ROM. Patterns are naturally expanded since every bar still
+ * holds its events, the loop is played twice. Engine commands without a
+ * MIDI equivalent are written as the same text events that set them.
+ */
+static void agb_emit_midi(const std::filesystem::path& path) {
+    using namespace cppmidi;
+
+    midi_file out;
+    out.convert_time_division(24);
+
+    // conductor track for tempo and loop markers
+    out.midi_tracks.emplace_back();
+
+    uint32_t loop_start = 0, loop_end = 0;
+    bool has_loop = false;
+    for (const agb_track& atrk : as.tracks) {
+        for (const agb_timed_ev& tev : agb_track_timeline(atrk)) {
+            if (tev.ev.get().type == agb_ev::ty::LOOP_START)
+                loop_start = tev.tick;
+            if (tev.ev.get().type == agb_ev::ty::LOOP_END) {
+                loop_end = tev.tick;
+                has_loop = true;
+            }
+        }
+    }
+    has_loop = has_loop && loop_end > loop_start;
+    const uint32_t loop_len = loop_end - loop_start;
+    if (has_loop) {
+        out[0].midi_events.emplace_back(new marker_meta_midi_event(loop_start, "loopStart"));
+        out[0].midi_events.emplace_back(new marker_meta_midi_event(loop_end, "loopEnd"));
+    }
+
+    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
+        out.midi_tracks.emplace_back();
+        midi_track& otrk = out.midi_tracks.back();
+        int chn_num = trk_get_channel_num(mf[itrk]);
+        const uint8_t chn = static_cast<uint8_t>(chn_num >= 0 ? chn_num : itrk & 0xF);
+
+        std::vector<agb_timed_ev> timeline = agb_track_timeline(as.tracks[itrk]);
+        // the second loop iteration
+        if (has_loop) {
+            size_t num_events = timeline.size();
+            for (size_t i = 0; i < num_events; i++) {
+                const agb_timed_ev tev = timeline[i];
+                if (tev.tick < loop_start || tev.tick >= loop_end)
+                    continue;
+                if (tev.ev.get().type == agb_ev::ty::LOOP_START)
+                    continue;
+                timeline.emplace_back(tev.tick + loop_len, tev.bar, tev.ev.get());
+            }
+        }
+
+        for (const agb_timed_ev& tev : timeline) {
+            const agb_ev& ev = tev.ev;
+            const uint32_t t = tev.tick;
+            std::vector<midi_event *> evs;
+            auto text = [&](const char *key, int value) {
+                evs.push_back(new text_meta_midi_event(t,
+                            std::string(key) + "=" + std::to_string(value)));
+            };
+            switch (ev.type) {
+            case agb_ev::ty::TEMPO:
+                out[0].midi_events.emplace_back(new tempo_meta_midi_event(t,
+                            static_cast<uint32_t>(60000000 / std::max(1, ev.tempo * 2))));
+                break;
+            case agb_ev::ty::VOICE:
+                evs.push_back(new program_message_midi_event(t, chn, ev.voice));
+                break;
+            case agb_ev::ty::VOL:
+                evs.push_back(new controller_message_midi_event(t, chn,
+                            MIDI_CC_MSB_VOLUME, ev.vol));
+                break;
+            case agb_ev::ty::PAN:
+                evs.push_back(new controller_message_midi_event(t, chn,
+                            MIDI_CC_MSB_PAN, static_cast<uint8_t>(64 + ev.pan)));
+                break;
+            case agb_ev::ty::BEND:
+                evs.push_back(new pitchbend_message_midi_event(t, chn,
+                            static_cast<int16_t>(ev.bend * 128)));
+                break;
+            case agb_ev::ty::BENDR:
+                evs.push_back(new controller_message_midi_event(t, chn, MIDI_CC_MSB_RPN, 0));
+                evs.push_back(new controller_message_midi_event(t, chn, MIDI_CC_LSB_RPN, 0));
+                evs.push_back(new controller_message_midi_event(t, chn,
+                            MIDI_CC_MSB_DATA_ENTRY, ev.bendr));
+                break;
+            case agb_ev::ty::MOD:
+                evs.push_back(new controller_message_midi_event(t, chn,
+                            MIDI_CC_MSB_MOD, ev.mod));
+                break;
+            case agb_ev::ty::TUNE:
+                // fine tuning RPN for listening, the text to convert it back
+                evs.push_back(new controller_message_midi_event(t, chn, MIDI_CC_MSB_RPN, 0));
+                evs.push_back(new controller_message_midi_event(t, chn, MIDI_CC_LSB_RPN, 1));
+                evs.push_back(new controller_message_midi_event(t, chn,
+                            MIDI_CC_MSB_DATA_ENTRY, static_cast<uint8_t>(64 + ev.tune)));
+                text("tune", ev.tune);
+                break;
+            case agb_ev::ty::MODT:
+                text("modt", ev.modt);
+                break;
+            case agb_ev::ty::LFOS:
+                text("lfos", ev.lfos);
+                break;
+            case agb_ev::ty::LFODL:
+                text("lfodl", ev.lfodl);
+                break;
+            case agb_ev::ty::PRIO:
+                text("prio", ev.prio);
+                break;
+            case agb_ev::ty::XCMD:
+                text(ev.xcmd.type == AGB_XCMD_XIECV ? "xiecv" : "xiecl", ev.xcmd.par);
+                break;
+            case agb_ev::ty::TIE:
+                evs.push_back(new noteon_message_midi_event(t, chn, ev.tie.key, ev.tie.vel));
+                break;
+            case agb_ev::ty::EOT:
+                evs.push_back(new noteoff_message_midi_event(t, chn, ev.eot.key, 64));
+                break;
+            case agb_ev::ty::NOTE:
+                evs.push_back(new noteon_message_midi_event(t, chn, ev.note.key, ev.note.vel));
+                evs.push_back(new noteoff_message_midi_event(t + ev.note.len, chn,
+                            ev.note.key, 64));
+                break;
+            default:
+                break;
+            }
+            for (midi_event *mev : evs)
+                otrk.midi_events.emplace_back(mev);
+        }
+        // note offs were inserted before events at the same tick
+        std::stable_sort(otrk.midi_events.begin(), otrk.midi_events.end(), ev_tick_cmp);
+
+        // a TIE may start before the loop and end within it, so the second
+        // iteration contains an EOT without a note, remove those
+        std::array<int, 128> active{};
+        std::vector<std::unique_ptr<midi_event>> events;
+        for (std::unique_ptr<midi_event>& mev : otrk.midi_events) {
+            if (typeid(*mev) == typeid(noteon_message_midi_event)) {
+                active[static_cast<noteon_message_midi_event&>(*mev).get_key()] += 1;
+            } else if (typeid(*mev) == typeid(noteoff_message_midi_event)) {
+                int& count = active[static_cast<noteoff_message_midi_event&>(*mev).get_key()];
+                if (count == 0)
+                    continue;
+                count -= 1;
+            }
+            events.emplace_back(std::move(mev));
+        }
+        // and the TIE at the end of the loop may lose its EOT
+        uint32_t end_tick = events.empty() ? 0 : events.back()->ticks;
+        for (uint8_t key = 0; key < 128; key++) {
+            for (; active[key] > 0; active[key]--)
+                events.emplace_back(new noteoff_message_midi_event(end_tick, chn, key, 64));
+        }
+        otrk.midi_events = std::move(events);
+    }
+    std::stable_sort(out[0].midi_events.begin(), out[0].midi_events.end(), ev_tick_cmp);
+
+    out.save_to_file(path.string());
+}
+
+/*
+ * Lean assembly:
+ *
+ * With --lean-asm everything written by agb_out() goes through
+ * lean_asm_line() instead of being written directly. It evaluates the
+ * MPlayDef symbols and expressions of each .byte line and collects the
+ * values, which are then written as long .byte lines of plain numbers.
+ * Comments are dropped and MPlayDef.s does not need to be included, so
+ * the assembler has a lot less to parse. Since write_event() still
+ * decides what to write, the bytes are the same as in the regular output.
+ */
+struct lean_asm_state {
+    std::unordered_map<std::string, long> symbols;
+    std::vector<long> values;
+};
+
+static lean_asm_state lean_asm;
+
+static void lean_asm_init() {
+    static const char *cmd_names[] = {
+        "FINE", "GOTO", "PATT", "PEND", "REPT", nullptr, nullptr, nullptr,
+        "MEMACC", "PRIO", "TEMPO", "KEYSH", "VOICE", "VOL", "PAN", "BEND",
+        "BENDR", "LFOS", "LFODL", "MOD", "MODT", nullptr, nullptr, "TUNE",
+        nullptr, nullptr, nullptr, nullptr, "XCMD", "EOT", "TIE",
+    };
+    static const char *key_names[12] = {
+        "Cn", "Cs", "Dn", "Ds", "En", "Fn", "Fs", "Gn", "Gs", "An", "As", "Bn"
+    };
+    // lengths which have their own W?? and N?? command
+    static const uint8_t lengths[] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19,
+        20, 21, 22, 23, 24, 28, 30, 32, 36, 40, 42, 44, 48, 52, 54, 56, 60,
+        64, 66, 68, 72, 76, 78, 80, 84, 88, 90, 92, 96,
+    };
+    std::unordered_map<std::string, long>& sym = lean_asm.symbols;
+    if (!sym.empty())
+        return;
+
+    for (size_t i = 0; i < sizeof(cmd_names) / sizeof(cmd_names[0]); i++) {
+        if (cmd_names[i])
+            sym[cmd_names[i]] = static_cast<long>(0xB1 + i);
+    }
+    char name[16];
+    for (size_t i = 0; i < sizeof(lengths); i++) {
+        snprintf(name, sizeof(name), "W%02d", lengths[i]);
+        sym[name] = static_cast<long>(0x80 + i);
+        if (lengths[i] > 0) {
+            snprintf(name, sizeof(name), "N%02d", lengths[i]);
+            sym[name] = static_cast<long>(0xD0 + i - 1);
+        }
+    }
+    for (int key = 0; key < 128; key++) {
+        int octave = key / 12 - 2;
+        if (octave < 0)
+            snprintf(name, sizeof(name), "%sM%d", key_names[key % 12], -octave);
+        else
+            snprintf(name, sizeof(name), "%s%d", key_names[key % 12], octave);
+        sym[name] = key;
+        snprintf(name, sizeof(name), "v%03d", key);
+        sym[name] = key;
+    }
+    sym["gtp1"] = 1;
+    sym["gtp2"] = 2;
+    sym["gtp3"] = 3;
+    sym["c_v"] = 0x40;
+    sym["mod_vib"] = 0;
+    sym["mod_tre"] = 1;
+    sym["mod_pan"] = 2;
+    sym["reverb_set"] = 0x80;
+}
+
+// evaluates a term list like "c_v-5" or "120/2" from left to right
+static bool lean_asm_eval(const std::string& expr, long& result) {
+    size_t pos = 0;
+    char op = '+';
+    result = 0;
+    while (pos < expr.size()) {
+        size_t end = expr.find_first_of("+-*/", pos + 1);
+        if (end == std::string::npos)
+            end = expr.size();
+        std::string term = expr.substr(pos, end - pos);
+        term.erase(0, term.find_first_not_of(" \t"));
+        term.erase(term.find_last_not_of(" \t") + 1);
+        if (term.empty())
+            return false;
+
+        long value;
+        if (isdigit(static_cast<unsigned char>(term[0]))) {
+            value = strtol(term.c_str(), nullptr, 0);
+        } else {
+            auto it = lean_asm.symbols.find(term);
+            if (it == lean_asm.symbols.end())
+                return false;
+            value = it->second;
+        }
+        switch (op) {
+        case '+': result += value; break;
+        case '-': result -= value; break;
+        case '*': result *= value; break;
+        case '/': if (value == 0) return false; result /= value; break;
+        }
+        if (end >= expr.size())
+            break;
+        op = expr[end];
+        pos = end + 1;
+    }
+    return true;
+}
+
+static void lean_asm_flush(std::ofstream& ofs) {
+    std::vector<long>& values = lean_asm.values;
+    for (size_t i = 0; i < values.size(); i++) {
+        ofs << (i % 32 == 0 ? ".byte " : ",") << values[i];
+        if (i % 32 == 31 || i + 1 == values.size())
+            ofs << "\n";
+    }
+    values.clear();
+}
+
+static void lean_asm_line(std::ofstream& ofs, std::string line) {
+    size_t comment = line.find('@');
+    if (comment != std::string::npos)
+        line.erase(comment);
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t") + 1);
+    if (line.empty())
+        return;
+
+    bool is_byte = !line.compare(0, 6, ".byte ");
+    bool is_hword = !line.compare(0, 7, ".hword ");
+    if (is_byte || is_hword) {
+        size_t pos = line.find(' ');
+        while (pos < line.size()) {
+            size_t end = line.find(',', pos + 1);
+            if (end == std::string::npos)
+                end = line.size();
+            long value;
+            if (!lean_asm_eval(line.substr(pos + 1, end - pos - 1), value))
+                die("--lean-asm: can't evaluate \"%s\"\n", line.c_str());
+            lean_asm.values.push_back(value & 0xFF);
+            if (is_hword)
+                lean_asm.values.push_back((value >> 8) & 0xFF);
+            pos = end;
+        }
+        return;
+    }
+
+    lean_asm_flush(ofs);
+    if (!line.compare(0, 9, ".include ")) {
+        // all symbols are evaluated already
+        return;
+    } else if (!line.compare(0, 5, ".equ ")) {
+        size_t sep = line.find(',');
+        std::string name = line.substr(5, sep - 5);
+        name.erase(0, name.find_first_not_of(" \t"));
+        long value;
+        if (sep != std::string::npos && lean_asm_eval(line.substr(sep + 1), value)) {
+            lean_asm.symbols[name] = value;
+            ofs << ".equ " << name << "," << value << "\n";
+            return;
+        }
+    } else if (line.back() == ':' && line.find(' ') == std::string::npos) {
+        ofs << line << "\n";
+        return;
+    }
+    // other directives are copied with their whitespace cleaned up
+    size_t sp = line.find_first_of(" \t");
+    if (sp != std::string::npos) {
+        size_t arg = line.find_first_not_of(" \t", sp);
+        line = line.substr(0, sp) + " " + line.substr(arg);
+    }
+    ofs << line << "\n";
 }
 
 static void agb_comment_line(std::ofstream& ofs, const char *fmt, ...) {
+    if (arg_lean_asm)
+        return;
+
     va_list args;
     va_start(args, fmt);
     char buf[256];
@@ -1522,15 +5005,73 @@ static void agb_comment_line(std::ofstream& ofs, const char *fmt, ...) {
     ofs << buf_final << std::endl;
 }
 
+/*
+ * agb_out_counting : agb_out() only adds up the bytes of the data
+ * directives instead of writing, used for measuring the exact song size
+ * including running status
+ */
+static bool agb_out_counting = false;
+static size_t agb_out_bytes = 0;
+
+static void agb_count_bytes(const char *text) {
+    while (*text) {
+        const char *end = strchr(text, '\n');
+        if (!end)
+            end = text + strlen(text);
+        const char *p = text;
+        while (p < end && *p == ' ')
+            p++;
+        size_t item_size = 0;
+        if (strncmp(p, ".byte", 5) == 0)
+            item_size = 1;
+        else if (strncmp(p, ".word", 5) == 0)
+            item_size = 4;
+        if (item_size > 0) {
+            size_t items = 1;
+            for (; p < end && *p != '@'; p++) {
+                if (*p == ',')
+                    items++;
+            }
+            agb_out_bytes += items * item_size;
+        }
+        text = *end ? end + 1 : end;
+    }
+}
+
 static void agb_out(std::ofstream& ofs, const char *msg, ...) {
     char buf[256];
     va_list args;
     va_start(args, msg);
     vsnprintf(buf, sizeof(buf), msg, args);
     va_end(args);
+    if (agb_out_counting) {
+        agb_count_bytes(buf);
+        return;
+    }
+    if (arg_lean_asm) {
+        const char *line = buf;
+        while (const char *nl = strchr(line, '\n')) {
+            lean_asm_line(ofs, std::string(line, nl));
+            line = nl + 1;
+        }
+        if (*line)
+            lean_asm_line(ofs, line);
+        return;
+    }
     ofs << buf;
 }
 
+/*
+ * agb_section() : starts a section for --sections
+ *
+ * Every song gets .rodata.<sym> for its header and .rodata.<sym>.<track>
+ * for each track (including the patterns defined in it). The linker can
+ * then drop songs which aren't referenced with --gc-sections.
+ */
+static void agb_section(std::ofstream& ofs, const std::string& name) {
+    agb_out(ofs, "        .section .rodata.%s,\"a\",%%progbits\n", name.c_str());
+}
+
 struct agb_state {
     agb_state()
         : cmd_state(cmd::INVALID), note_key(0xFF), note_vel(0xFF), note_len(0),
@@ -1581,6 +5122,7 @@ static void write_event(std::ofstream& ofs, agb_state& state, const agb_ev& ev,
     static const char *gate_names[3] = {
         "gtp1", "gtp2", "gtp3"
     };
+    count(ctr::WRITE_EVENT, static_cast<size_t>(ev.type));
     switch (ev.type) {
     case agb_ev::ty::WAIT:
         {
@@ -1872,91 +5414,350 @@ static void write_event(std::ofstream& ofs, agb_state& state, const agb_ev& ev,
     }
 }
 
-struct bar_dest {
-    bar_dest(size_t track, size_t bar)
-        : track(track), bar(bar) {}
+/*
+ * agb_find_patterns() : marks bars which are identical to an earlier bar
+ *
+ * The bars are hashed by multiple threads, each putting its candidates
+ * into its own set of shards selected by the hash. Identical bars always
+ * end up in the same shard, so the shards can be resolved independently.
+ * Within a shard the candidates are visited in (track, bar) order, which
+ * makes the first occurrence the pattern just like a serial run would.
+ */
+struct bar_candidate {
+    size_t hash;
     size_t track, bar;
 };
 
-static void write_agb() {
-    using namespace cppmidi;
+static const size_t PATTERN_SHARDS = 64;
 
-    std::ofstream fout(arg_output_file, std::ios::out);
-    if (!fout.is_open())
-        die("Unable to open output file: %s\n", strerror(errno));
+static bool agb_bar_is_pattern_candidate(const agb_bar& abar) {
+    if (abar.size() <= 5 || abar.no_pattern)
+        return false;
+    for (const agb_ev& ev : abar.events) {
+        // if one event contains a loop end, don't make it callable
+        // otherwise other tracks might call the loop end which will
+        // make things go out of order
+        if (ev.type == agb_ev::ty::LOOP_END)
+            return false;
+        if (ev.type == agb_ev::ty::LOOP_START)
+            return false;
+    }
+    return true;
+}
+
+static void agb_run_parallel(size_t num_items, const std::function<void(size_t)>& fn) {
+    size_t num_threads = std::min<size_t>(arg_jobs, num_items);
+    if (num_threads <= 1) {
+        for (size_t i = 0; i < num_items; i++)
+            fn(i);
+        return;
+    }
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&]() {
+            for (size_t i = next++; i < num_items; i = next++)
+                fn(i);
+        });
+    }
+    for (std::thread& th : threads)
+        th.join();
+}
 
-    // pair: first = track, second bar index
-    std::unordered_map<
-        std::reference_wrapper<agb_bar>,
-        bar_dest,
-        agb_bar_ref_hasher,
-        agb_bar_ref_hasher>
-            compression_table;
+static void agb_find_patterns() {
+    // one set of shards per track, so the hashing threads never share any
+    std::vector<std::array<std::vector<bar_candidate>, PATTERN_SHARDS>>
+        track_shards(as.tracks.size());
 
-    // fill compression table
-    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
-        agb_track& atrk = as.tracks[itrk];
+    agb_run_parallel(as.tracks.size(), [&](size_t itrk) {
+        const agb_track& atrk = as.tracks[itrk];
         for (size_t ibar = 0; ibar < atrk.bars.size(); ibar++) {
-            agb_bar& abar = atrk.bars[ibar];
+            const agb_bar& abar = atrk.bars[ibar];
             if (abar.events.size() == 0) {
                 // this should only happen for events in the beginning
                 // of the very last bar in the track
                 assert(ibar + 1 == atrk.bars.size());
                 continue;
             }
-            if (abar.size() <= 5)
+            if (!agb_bar_is_pattern_candidate(abar))
                 continue;
-            for (size_t ievt = 0; ievt < abar.events.size(); ievt++) {
-                // if one event contains a loop end, don't make it callable
-                // otherwise other tracks might call the loop end which will
-                // make things go out of order
-                if (abar.events[ievt].type == agb_ev::ty::LOOP_END)
-                    goto outer_continue;
-                if (abar.events[ievt].type == agb_ev::ty::LOOP_START)
-                    goto outer_continue;
-            }
-            {
-                auto result = compression_table.insert(
-                        std::pair<std::reference_wrapper<agb_bar>, bar_dest>(
-                            abar, bar_dest(itrk, ibar)));
-                if (!result.second) {
+            size_t hash = abar.hash();
+            track_shards[itrk][hash % PATTERN_SHARDS].push_back({hash, itrk, ibar});
+        }
+    });
+
+    // every bar is in exactly one shard, so only that shard's thread
+    // writes the bar's flags
+    agb_run_parallel(PATTERN_SHARDS, [&](size_t ishard) {
+        // first occurrences of each hash
+        std::unordered_map<size_t, std::vector<const bar_candidate *>> table;
+        // tracks and bars of each track are already in order
+        for (size_t itrk = 0; itrk < track_shards.size(); itrk++) {
+            for (const bar_candidate& cand : track_shards[itrk][ishard]) {
+                agb_bar& abar = as.tracks[cand.track].bars[cand.bar];
+                count(ctr::HASH_PROBES);
+                std::vector<const bar_candidate *>& firsts = table[cand.hash];
+                bool found = false;
+                for (const bar_candidate *first : firsts) {
+                    agb_bar& fbar = as.tracks[first->track].bars[first->bar];
+                    count(ctr::BAR_COMPARES);
+                    if (fbar != abar)
+                        continue;
                     // if bar already is inserted, trigger its reference count
-                    as.tracks[result.first->second.track].bars[result.first->second.bar].is_referenced = true;
+                    fbar.is_referenced = true;
                     // mark reference origin
                     abar.does_reference = true;
+                    abar.ref_track = first->track;
+                    abar.ref_bar = first->bar;
+                    found = true;
+                    break;
                 }
+                if (!found)
+                    firsts.push_back(&cand);
             }
-outer_continue:
-            ;
+        }
+    });
+}
+
+/*
+ * write_fixed_stream() : alternative output for custom players
+ *
+ * Every event is written as two aligned words without running status or
+ * patterns, see player/fixed_stream.h for the format and a decoder.
+ * Waits are folded into the delta of the preceding event.
+ */
+enum class fs_cmd : uint8_t {
+    WAIT, FINE, GOTO, PRIO, TEMPO, KEYSH, VOICE, VOL, PAN, BEND, BENDR,
+    LFOS, LFODL, MOD, MODT, TUNE, XCMD, EOT, TIE, NOTE,
+};
+
+static const char *fs_cmd_names[] = {
+    "WAIT", "FINE", "GOTO", "PRIO", "TEMPO", "KEYSH", "VOICE", "VOL", "PAN",
+    "BEND", "BENDR", "LFOS", "LFODL", "MOD", "MODT", "TUNE", "XCMD", "EOT",
+    "TIE", "NOTE",
+};
+
+struct fs_event {
+    fs_event(fs_cmd cmd, uint8_t arg0 = 0, uint8_t arg1 = 0, uint16_t len = 0)
+        : cmd(cmd), arg0(arg0), arg1(arg1), delta(0), len(len) {}
+    fs_cmd cmd;
+    uint8_t arg0, arg1;
+    uint16_t delta, len;
+};
+
+static std::vector<fs_event> fs_track_events(const agb_track& atrk) {
+    // the first event is the song's key shift, see write_fixed_stream()
+    std::vector<fs_event> events{fs_event(fs_cmd::KEYSH)};
+    // a wait directly after the loop start must not be folded into the
+    // event before it, otherwise it would not be repeated
+    bool may_fold = true;
+    size_t loop_index = 0;
+    // TIEs waiting for their EOT: event index and tick of the TIE
+    uint32_t tick = 0;
+    std::vector<std::pair<size_t, uint32_t>> open_ties[128];
+
+    for (const agb_bar& abar : atrk.bars) {
+        for (const agb_ev& ev : abar.events) {
+            switch (ev.type) {
+            case agb_ev::ty::WAIT:
+                {
+                    tick += ev.wait;
+                    uint32_t wait = ev.wait;
+                    while (wait > 0) {
+                        if (!may_fold || events.back().delta == 0xFFFF) {
+                            events.emplace_back(fs_cmd::WAIT);
+                            may_fold = true;
+                        }
+                        uint32_t w = std::min<uint32_t>(wait, 0xFFFFu - events.back().delta);
+                        events.back().delta = static_cast<uint16_t>(events.back().delta + w);
+                        wait -= w;
+                    }
+                }
+                continue;
+            case agb_ev::ty::LOOP_START:
+                loop_index = events.size();
+                may_fold = false;
+                continue;
+            case agb_ev::ty::LOOP_END:
+                events.emplace_back(fs_cmd::GOTO,
+                        0, 0, static_cast<uint16_t>(loop_index >> 16));
+                events.back().delta = static_cast<uint16_t>(loop_index);
+                may_fold = false;
+                // TIEs still open at the jump keep M2A_FS_TIE_LEN
+                for (auto& ties : open_ties)
+                    ties.clear();
+                continue;
+            case agb_ev::ty::PRIO:
+                events.emplace_back(fs_cmd::PRIO, ev.prio);
+                break;
+            case agb_ev::ty::TEMPO:
+                events.emplace_back(fs_cmd::TEMPO, ev.tempo);
+                break;
+            case agb_ev::ty::KEYSH:
+                events.emplace_back(fs_cmd::KEYSH, static_cast<uint8_t>(ev.keysh));
+                break;
+            case agb_ev::ty::VOICE:
+                events.emplace_back(fs_cmd::VOICE, ev.voice);
+                break;
+            case agb_ev::ty::VOL:
+                events.emplace_back(fs_cmd::VOL, ev.vol);
+                break;
+            case agb_ev::ty::PAN:
+                events.emplace_back(fs_cmd::PAN, static_cast<uint8_t>(64 + ev.pan));
+                break;
+            case agb_ev::ty::BEND:
+                events.emplace_back(fs_cmd::BEND, static_cast<uint8_t>(64 + ev.bend));
+                break;
+            case agb_ev::ty::BENDR:
+                events.emplace_back(fs_cmd::BENDR, ev.bendr);
+                break;
+            case agb_ev::ty::LFOS:
+                events.emplace_back(fs_cmd::LFOS, ev.lfos);
+                break;
+            case agb_ev::ty::LFODL:
+                events.emplace_back(fs_cmd::LFODL, ev.lfodl);
+                break;
+            case agb_ev::ty::MOD:
+                events.emplace_back(fs_cmd::MOD, ev.mod);
+                break;
+            case agb_ev::ty::MODT:
+                events.emplace_back(fs_cmd::MODT, ev.modt);
+                break;
+            case agb_ev::ty::TUNE:
+                events.emplace_back(fs_cmd::TUNE, static_cast<uint8_t>(64 + ev.tune));
+                break;
+            case agb_ev::ty::XCMD:
+                events.emplace_back(fs_cmd::XCMD, ev.xcmd.type, ev.xcmd.par);
+                break;
+            case agb_ev::ty::EOT:
+                {
+                    // the EOT ends the oldest TIE of its key
+                    auto& ties = open_ties[ev.eot.key & 0x7F];
+                    if (ties.size() > 0) {
+                        uint32_t len = tick - ties.front().second;
+                        if (len < 0xFFFF)
+                            events[ties.front().first].len = static_cast<uint16_t>(len);
+                        ties.erase(ties.begin());
+                    }
+                    events.emplace_back(fs_cmd::EOT, ev.eot.key);
+                }
+                break;
+            case agb_ev::ty::TIE:
+                open_ties[ev.tie.key & 0x7F].emplace_back(events.size(), tick);
+                events.emplace_back(fs_cmd::TIE, ev.tie.key, ev.tie.vel, 0xFFFF);
+                break;
+            case agb_ev::ty::NOTE:
+                events.emplace_back(fs_cmd::NOTE, ev.note.key, ev.note.vel, ev.note.len);
+                break;
+            }
+            may_fold = true;
         }
     }
+    events.emplace_back(fs_cmd::FINE);
+    return events;
+}
+
+static void write_fixed_stream() {
+    std::ofstream fout(arg_output_file, std::ios::out);
+    if (!fout.is_open())
+        die("Unable to open output file: %s\n", strerror(errno));
+    if (arg_lean_asm)
+        lean_asm_init();
+
+    agb_out(fout, "        .equ    %s_grp, %s\n", arg_sym.c_str(), arg_vgr.c_str());
+    agb_out(fout, "        .equ    %s_pri, %d\n", arg_sym.c_str(), arg_pri);
+    // MPlayDef.s isn't included, so reverb_set (0x80) is resolved here
+    if (arg_rev > 0) {
+        agb_out(fout, "        .equ    %s_rev, %d\n",
+                arg_sym.c_str(), 0x80 | arg_rev);
+    } else {
+        agb_out(fout, "        .equ    %s_rev, 0\n",
+                arg_sym.c_str());
+    }
+    agb_out(fout, "        .equ    %s_key, 0\n\n", arg_sym.c_str());
+    if (arg_sections) {
+        agb_out(fout, "        .global %s\n\n", arg_sym.c_str());
+    } else {
+        agb_out(fout, "        .section .rodata\n");
+        agb_out(fout, "        .global %s\n", arg_sym.c_str());
+        agb_out(fout, "        .align  2\n\n");
+    }
+
+    size_t total_events = 0;
+    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
+        std::vector<fs_event> events = fs_track_events(as.tracks[itrk]);
+        total_events += events.size();
+
+        agb_comment_line(fout, "Track %zu (Midi-Chn.%d)", itrk,
+                trk_get_channel_num(mf[itrk]));
+        // a new section starts byte aligned, the records need words
+        if (arg_sections) {
+            agb_section(fout, arg_sym + "." + std::to_string(itrk));
+            agb_out(fout, "        .align  2\n");
+        }
+        agb_out(fout, "\n%s_%zu:\n", arg_sym.c_str(), itrk);
+        for (size_t iev = 0; iev < events.size(); iev++) {
+            const fs_event& ev = events[iev];
+            if (iev == 0) {
+                agb_out(fout, "        .byte   %-3u, %s_key+0, 0, 0 @ KEYSH\n",
+                        static_cast<unsigned>(fs_cmd::KEYSH), arg_sym.c_str());
+            } else {
+                agb_out(fout, "        .byte   %-3u, %-3u, %-3u, 0 @ %s\n",
+                        static_cast<unsigned>(ev.cmd), ev.arg0, ev.arg1,
+                        fs_cmd_names[static_cast<size_t>(ev.cmd)]);
+            }
+            agb_out(fout, "        .hword  %u, %u\n", ev.delta, ev.len);
+        }
+        agb_out(fout, "\n");
+    }
+
+    agb_comment_line(fout, "End of Song");
+    if (arg_sections) {
+        agb_out(fout, "\n");
+        agb_section(fout, arg_sym);
+    }
+    agb_out(fout, "\n        .align  2\n");
+    agb_out(fout, "%s:\n", arg_sym.c_str());
+    agb_out(fout, "        .byte   %-23zu @ Num Tracks\n", as.tracks.size());
+    agb_out(fout, "        .byte   %-23zu @ Unknown\n", 0);
+    agb_out(fout, "        .byte   %-23s @ Priority\n",
+            (arg_sym + "_pri").c_str());
+    agb_out(fout, "        .byte   %-23s @ Reverb\n\n",
+            (arg_sym + "_rev").c_str());
+    agb_out(fout, "        .word   %-23s\n\n",
+            (arg_sym + "_grp").c_str());
 
-    // write header
-    agb_out(fout, "        .include \"MPlayDef.s\"\n\n");
-    agb_out(fout, "        .equ    %s_grp, %s\n", arg_sym.c_str(), arg_vgr.c_str());
-    agb_out(fout, "        .equ    %s_pri, %d\n", arg_sym.c_str(), arg_pri);
-    if (arg_rev > 0) {
-        agb_out(fout, "        .equ    %s_rev, %d+reverb_set\n",
-                arg_sym.c_str(), arg_rev);
-    } else {
-        agb_out(fout, "        .equ    %s_rev, 0\n",
-                arg_sym.c_str());
+    for (size_t i = 0; i < as.tracks.size(); i++) {
+        agb_out(fout, "        .word   %s_%zu\n", arg_sym.c_str(), i);
     }
-    agb_out(fout, "        .equ    %s_key, 0\n\n", arg_sym.c_str());
-    agb_out(fout, "        .section .rodata\n");
-    agb_out(fout, "        .global %s\n", arg_sym.c_str());
-    agb_out(fout, "        .align  2\n\n");
 
-    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
-        assert(as.tracks.size() == mf.midi_tracks.size());
-        const midi_track& mtrk = mf[itrk];
+    agb_out(fout, "\n        .end\n");
+
+    if (fout.bad())
+        die("std::ofstream::bad\n");
+    if (fout.fail())
+        die("std::ofstream::fail\n");
+    fout.close();
+
+    dbg("fixed stream: %zu events, %zu bytes\n", total_events,
+            total_events * 8 + 8 + 4 * as.tracks.size());
+}
+
+// writes all tracks of the song, channels are only used for the comments
+static void write_agb_tracks(std::ofstream& fout, const std::vector<int>& channels,
+        size_t first, size_t end) {
+    for (size_t itrk = first; itrk < end; itrk++) {
         agb_track& atrk = as.tracks[itrk];
 
         agb_state state;
 
-        agb_comment_line(fout, "Track %zu (Midi-Chn.%d)", itrk,
-                trk_get_channel_num(mtrk));
+        agb_comment_line(fout, "Track %zu (Midi-Chn.%d)", itrk, channels[itrk]);
 
+        if (arg_sections)
+            agb_section(fout, arg_sym + "." + std::to_string(itrk));
+        // with --split-output the header and other tracks are in other files
+        if (arg_split_output > 0)
+            agb_out(fout, "\n        .global %s_%zu", arg_sym.c_str(), itrk);
         agb_out(fout, "\n%s_%zu:\n", arg_sym.c_str(), itrk);
         agb_out(fout, "        .byte   KEYSH , %s_key+0\n", arg_sym.c_str());
 
@@ -1971,6 +5772,8 @@ outer_continue:
                 // In some cases the compressor will decide to not call this section
                 // in the end due to smaller space usage without a call. Probably a bit
                 // more complicated to fix.
+                if (arg_split_output > 0)
+                    agb_out(fout, "        .global %s_%zu_%zu\n", arg_sym.c_str(), itrk, ibar);
                 agb_out(fout, "%s_%zu_%zu:\n", arg_sym.c_str(), itrk, ibar);
                 state.reset();
             }
@@ -1980,17 +5783,12 @@ outer_continue:
                     write_event(fout, state, abar.events[ievt], itrk);
                 }
             } else {
-                std::reference_wrapper<agb_bar> key(abar);
-                auto result = compression_table.find(key);
-                // if this bar references another it must be found
-                assert(result != compression_table.end());
-
-                size_t track_refed = result->second.track;
-                size_t bar_refed = result->second.bar;
+                // if this bar references another it must be a pattern
+                assert(as.tracks[abar.ref_track].bars[abar.ref_bar].is_referenced);
 
                 agb_out(fout, "        .byte   PATT\n");
                 agb_out(fout, "         .word  %s_%zu_%zu\n", arg_sym.c_str(),
-                        track_refed, bar_refed);
+                        abar.ref_track, abar.ref_bar);
                 state.reset();
             }
 
@@ -1999,8 +5797,125 @@ outer_continue:
         }
         agb_out(fout, "        .byte   FINE\n\n");
     }
+}
+
+static void write_agb() {
+    using namespace cppmidi;
+
+    if (arg_fixed_stream) {
+        write_fixed_stream();
+        return;
+    }
+    if (!arg_sfx_bank_file.empty()) {
+        sfx_bank_add();
+        return;
+    }
+
+    std::ofstream fout(arg_output_file, std::ios::out);
+    if (!fout.is_open())
+        die("Unable to open output file: %s\n", strerror(errno));
+    if (arg_lean_asm)
+        lean_asm_init();
+
+    agb_find_patterns();
+    write_agb_song(fout, arg_split_output == 0);
+
+    if (fout.bad())
+        die("std::ofstream::bad\n");
+    if (fout.fail())
+        die("std::ofstream::fail\n");
+    fout.close();
+
+    if (arg_split_output > 0)
+        write_agb_split();
+}
+
+static std::vector<int> song_channels() {
+    assert(as.tracks.size() == mf.midi_tracks.size());
+    std::vector<int> channels;
+    for (const cppmidi::midi_track& mtrk : mf.midi_tracks)
+        channels.push_back(trk_get_channel_num(mtrk));
+    return channels;
+}
+
+/*
+ * write_agb_split() : --split-output
+ *
+ * The header stays in the output file, the tracks are written in groups of
+ * arg_split_output to <output>.<group>.s, so the build can assemble them in
+ * parallel. Track and pattern labels are global since the header and PATT
+ * calls from other groups refer to them, GOTO only jumps within its track.
+ * All files of the song are listed in <output>.files.
+ */
+static void write_agb_split() {
+    const std::vector<int> channels = song_channels();
+    std::filesystem::path stem = arg_output_file;
+    stem.replace_extension("");
+    std::vector<std::filesystem::path> files{ arg_output_file };
+
+    for (size_t first = 0; first < as.tracks.size(); first += arg_split_output) {
+        std::filesystem::path path = stem;
+        path += "." + std::to_string(files.size() - 1) + ".s";
+        std::ofstream fout(path, std::ios::out);
+        if (!fout.is_open())
+            die("Unable to open output file: %s\n", strerror(errno));
+
+        agb_out(fout, "        .include \"MPlayDef.s\"\n\n");
+        agb_out(fout, "        .equ    %s_key, 0\n\n", arg_sym.c_str());
+        if (!arg_sections)
+            agb_out(fout, "        .section .rodata\n\n");
+        write_agb_tracks(fout, channels, first,
+                std::min(first + arg_split_output, as.tracks.size()));
+        agb_out(fout, "        .end\n");
+
+        if (fout.bad() || fout.fail())
+            die("Unable to write output file\n");
+        files.push_back(path);
+    }
+
+    std::filesystem::path list_file = stem;
+    list_file += ".files";
+    std::ofstream flist(list_file, std::ios::out);
+    if (!flist.is_open())
+        die("Unable to open file list: %s\n", strerror(errno));
+    for (const std::filesystem::path& file : files)
+        flist << file.filename().string() << "\n";
+    if (flist.bad() || flist.fail())
+        die("Unable to write file list\n");
+    dbg("split output: %zu files listed in %s\n", files.size(), list_file.string().c_str());
+}
+
+static void write_agb_song(std::ofstream& fout, bool with_tracks) {
+    using namespace cppmidi;
+
+    // write header
+    agb_out(fout, "        .include \"MPlayDef.s\"\n\n");
+    agb_out(fout, "        .equ    %s_grp, %s\n", arg_sym.c_str(), arg_vgr.c_str());
+    agb_out(fout, "        .equ    %s_pri, %d\n", arg_sym.c_str(), arg_pri);
+    if (arg_rev > 0) {
+        agb_out(fout, "        .equ    %s_rev, %d+reverb_set\n",
+                arg_sym.c_str(), arg_rev);
+    } else {
+        agb_out(fout, "        .equ    %s_rev, 0\n",
+                arg_sym.c_str());
+    }
+    agb_out(fout, "        .equ    %s_key, 0\n\n", arg_sym.c_str());
+    if (arg_sections) {
+        agb_out(fout, "        .global %s\n\n", arg_sym.c_str());
+    } else {
+        agb_out(fout, "        .section .rodata\n");
+        agb_out(fout, "        .global %s\n", arg_sym.c_str());
+        agb_out(fout, "        .align  2\n\n");
+    }
+
+    if (with_tracks)
+        write_agb_tracks(fout, song_channels(), 0, as.tracks.size());
     agb_out(fout, "\n");
     agb_comment_line(fout, "End of Song");
+    if (arg_sections) {
+        agb_out(fout, "\n");
+        agb_section(fout, arg_sym);
+    }
     agb_out(fout, "\n        .align  2\n");
     agb_out(fout, "%s:\n", arg_sym.c_str());
     agb_out(fout, "        .byte   %-23zu @ Num Tracks\n", as.tracks.size());
@@ -2017,12 +5932,620 @@ outer_continue:
     }
 
     agb_out(fout, "\n        .end\n");
+}
 
-    if (fout.bad())
-        die("std::ofstream::bad\n");
-    if (fout.fail())
-        die("std::ofstream::fail\n");
+// exact size of the song's data as write_agb() would write it
+static size_t agb_song_bytes() {
+    std::ofstream null_stream;
+    agb_out_counting = true;
+    agb_out_bytes = 0;
+    write_agb_song(null_stream);
+    agb_out_counting = false;
+    return agb_out_bytes;
+}
+
+/*
+ * song_num_events() and song_verify() are used by the pass manager. Before
+ * midi_to_agb they look at the MIDI, afterwards at the agb song.
+ */
+static size_t song_num_events(bool agb) {
+    using namespace cppmidi;
+
+    size_t num_events = 0;
+    if (agb) {
+        for (const agb_track& atrk : as.tracks) {
+            for (const agb_bar& abar : atrk.bars)
+                num_events += abar.events.size();
+        }
+    } else {
+        for (const midi_track& mtrk : mf.midi_tracks) {
+            for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+                if (typeid(*ev) != typeid(dummy_midi_event))
+                    num_events += 1;
+            }
+        }
+    }
+    return num_events;
+}
+
+static verify_notes song_verify(bool agb, const char *after, const verify_notes *input) {
+    using namespace cppmidi;
+
+    auto fail = [after](size_t itrk, uint32_t tick, const char *what) {
+        die("verify: after %s: track %zu tick %u: %s\n", after, itrk, tick, what);
+    };
+
+    verify_notes notes;
+    if (!agb) {
+        for (size_t itrk = 0; itrk < mf.midi_tracks.size(); itrk++) {
+            const midi_track& mtrk = mf[itrk];
+            std::array<int, 128> open_notes{};
+            uint32_t prev_tick = 0;
+            for (const std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+                if (ev->ticks < prev_tick)
+                    fail(itrk, ev->ticks, "events not sorted");
+                prev_tick = ev->ticks;
+                if (typeid(*ev) == typeid(noteon_message_midi_event)) {
+                    const noteon_message_midi_event& nev =
+                        static_cast<const noteon_message_midi_event&>(*ev);
+                    if (nev.get_key() > 127 || nev.get_velocity() > 127)
+                        fail(itrk, ev->ticks, "Note ON out of range");
+                    open_notes[nev.get_key() & 0x7F] += 1;
+                } else if (typeid(*ev) == typeid(noteoff_message_midi_event)) {
+                    const noteoff_message_midi_event& nev =
+                        static_cast<const noteoff_message_midi_event&>(*ev);
+                    if (nev.get_key() > 127)
+                        fail(itrk, ev->ticks, "Note OFF out of range");
+                    if (open_notes[nev.get_key() & 0x7F] == 0)
+                        notes.stray_offs += 1;
+                    else
+                        open_notes[nev.get_key() & 0x7F] -= 1;
+                } else if (typeid(*ev) == typeid(controller_message_midi_event)) {
+                    const controller_message_midi_event& cev =
+                        static_cast<const controller_message_midi_event&>(*ev);
+                    if (cev.get_controller() > 127 || cev.get_value() > 127)
+                        fail(itrk, ev->ticks, "controller out of range");
+                } else if (typeid(*ev) == typeid(program_message_midi_event)) {
+                    if (static_cast<const program_message_midi_event&>(*ev).get_program() > 127)
+                        fail(itrk, ev->ticks, "program out of range");
+                } else if (typeid(*ev) == typeid(pitchbend_message_midi_event)) {
+                    int16_t pitch = static_cast<const pitchbend_message_midi_event&>(*ev).get_pitch();
+                    if (pitch < -8192 || pitch > 8191)
+                        fail(itrk, ev->ticks, "pitch bend out of range");
+                }
+            }
+            for (int open : open_notes)
+                notes.hanging += static_cast<size_t>(open);
+        }
+        // unpaired notes of the input are left to midi_to_agb and only
+        // reported, the passes mustn't add more of them
+        if (!input) {
+            if (notes.hanging > 0)
+                err("verify: after %s: warning, %zu Note ONs without Note OFF\n",
+                        after, notes.hanging);
+            if (notes.stray_offs > 0)
+                err("verify: after %s: warning, %zu Note OFFs without Note ON\n",
+                        after, notes.stray_offs);
+        } else if (notes.hanging > input->hanging) {
+            die("verify: after %s: Note ON without Note OFF\n", after);
+        } else if (notes.stray_offs > input->stray_offs) {
+            die("verify: after %s: Note OFF without Note ON\n", after);
+        }
+        return notes;
+    }
+
+    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
+        const agb_track& atrk = as.tracks[itrk];
+        std::array<int, 128> open_ties{};
+        uint32_t tick = 0;
+        for (size_t ibar = 0; ibar < atrk.bars.size(); ibar++) {
+            const agb_bar& abar = atrk.bars[ibar];
+            if (abar.does_reference) {
+                if (abar.is_referenced)
+                    fail(itrk, tick, "pattern calls another pattern");
+                if (abar.ref_track > itrk || (abar.ref_track == itrk && abar.ref_bar >= ibar))
+                    fail(itrk, tick, "pattern called before its definition");
+                const agb_bar& rbar = as.tracks[abar.ref_track].bars[abar.ref_bar];
+                if (!rbar.is_referenced || rbar != abar)
+                    fail(itrk, tick, "pattern call doesn't match the pattern");
+            }
+            for (const agb_ev& ev : abar.events) {
+                switch (ev.type) {
+                case agb_ev::ty::WAIT:
+                    if (ev.wait == 0)
+                        fail(itrk, tick, "empty wait");
+                    tick += ev.wait;
+                    break;
+                case agb_ev::ty::NOTE:
+                    if (ev.note.len == 0 || ev.note.len > 96 ||
+                            ev.note.key > 127 || ev.note.vel > 127)
+                        fail(itrk, tick, "note out of range");
+                    break;
+                case agb_ev::ty::TIE:
+                    if (ev.tie.key > 127 || ev.tie.vel > 127)
+                        fail(itrk, tick, "tie out of range");
+                    open_ties[ev.tie.key & 0x7F] += 1;
+                    break;
+                case agb_ev::ty::EOT:
+                    if (ev.eot.key > 127)
+                        fail(itrk, tick, "EOT out of range");
+                    if (open_ties[ev.eot.key & 0x7F]-- == 0)
+                        fail(itrk, tick, "EOT without TIE");
+                    break;
+                case agb_ev::ty::VOICE:
+                    if (ev.voice > 127)
+                        fail(itrk, tick, "voice out of range");
+                    break;
+                case agb_ev::ty::VOL:
+                    if (ev.vol > 127)
+                        fail(itrk, tick, "volume out of range");
+                    break;
+                case agb_ev::ty::PAN:
+                    if (ev.pan < -64 || ev.pan > 63)
+                        fail(itrk, tick, "pan out of range");
+                    break;
+                case agb_ev::ty::BEND:
+                    if (ev.bend < -64 || ev.bend > 63)
+                        fail(itrk, tick, "bend out of range");
+                    break;
+                case agb_ev::ty::TUNE:
+                    if (ev.tune < -64 || ev.tune > 63)
+                        fail(itrk, tick, "tune out of range");
+                    break;
+                default:
+                    break;
+                }
+            }
+        }
+    }
+    return notes;
+}
+
+/*
+ * Batch conversion:
+ *
+ * The manifest lists one song per line: "<input> [<output>]", paths are
+ * relative to the working directory and lines starting with '#' are
+ * ignored. All songs are converted with the same command line options.
+ *
+ * For distributing the work over multiple machines, --shard i/N converts
+ * only a part of the manifest. The songs are assigned largest first to
+ * the shard with the least total input size, which only depends on the
+ * manifest and the input files, so every machine computes the same
+ * partition. Each shard writes a summary with the song sizes and the bars
+ * that could become patterns shared between songs, --merge-shards combines
+ * the summaries of all shards.
+ */
+struct batch_entry {
+    std::filesystem::path input, output;
+    uintmax_t input_size;
+};
+
+// estimated output size in bytes, running status is not taken into account
+static size_t agb_song_size() {
+    size_t size = 8 + 4 * as.tracks.size();
+    for (const agb_track& atrk : as.tracks) {
+        // KEYSH and FINE
+        size += 3;
+        for (const agb_bar& abar : atrk.bars) {
+            if (abar.does_reference)
+                size += 5;
+            else
+                size += abar.size() + (abar.is_referenced ? 1 : 0);
+        }
+    }
+    return size;
+}
+
+/*
+ * agb_infer_bars() : converts again with the bar table from the notes
+ *
+ * The estimate in midi_infer_bars() doesn't know which bars become equal
+ * after the conversion and how much running status saves, so both variants
+ * are run through the pattern detection and the smaller one is kept.
+ */
+static void agb_infer_bars() {
+    using namespace cppmidi;
+
+    if (!arg_infer_bars)
+        return;
+
+    agb_find_patterns();
+    const size_t timesig_size = agb_song_bytes();
+    agb_song timesig_song = std::move(as);
+    as.tracks.clear();
+
+    // midi_to_agb marks the Note OFFs it has parsed
+    for (midi_track& mtrk : mf.midi_tracks) {
+        for (std::unique_ptr<midi_event>& ev : mtrk.midi_events) {
+            if (typeid(*ev) == typeid(noteoff_message_midi_event))
+                static_cast<noteoff_message_midi_event&>(*ev).set_velocity(MIDI_NOTE_PARSE_INIT);
+        }
+    }
+
+    size_t size = 0;
+    if (midi_to_agb(true)) {
+        agb_optimize();
+        agb_find_patterns();
+        size = agb_song_bytes();
+    }
+    if (size == 0 || size >= timesig_size) {
+        if (size > 0)
+            dbg("bar inference: time signatures kept (%zu instead of %zu bytes)\n",
+                    timesig_size, size);
+        as = std::move(timesig_song);
+    } else {
+        dbg("bar inference: %zu instead of %zu bytes\n", size, timesig_size);
+    }
+
+    // later passes may still change the bars, so patterns are searched again
+    for (agb_track& atrk : as.tracks) {
+        for (agb_bar& abar : atrk.bars) {
+            abar.is_referenced = false;
+            abar.does_reference = false;
+        }
+    }
+}
+
+static void batch_write_summary(std::ofstream& fout, const batch_entry& entry) {
+    size_t num_bars = 0;
+    std::vector<std::pair<uint64_t, size_t>> bars;
+    for (const agb_track& atrk : as.tracks) {
+        num_bars += atrk.bars.size();
+        for (const agb_bar& abar : atrk.bars) {
+            if (abar.size() <= 5)
+                continue;
+            bool has_loop = false;
+            for (const agb_ev& ev : abar.events) {
+                if (ev.type == agb_ev::ty::LOOP_START || ev.type == agb_ev::ty::LOOP_END)
+                    has_loop = true;
+            }
+            if (!has_loop)
+                bars.emplace_back(abar.fingerprint(), abar.size());
+        }
+    }
+    std::sort(bars.begin(), bars.end());
+    bars.erase(std::unique(bars.begin(), bars.end()), bars.end());
+
+    fout << "song " << agb_song_size() << " " << num_bars << " "
+        << entry.input.string() << "\n";
+    for (const auto& bar : bars) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "bar %016llx %zu ",
+                static_cast<unsigned long long>(bar.first), bar.second);
+        fout << buf << entry.input.string() << "\n";
+    }
+}
+
+// lines of a manifest as pairs of the first field and the rest (may be empty)
+static std::vector<std::pair<std::string, std::string>> manifest_read(
+        const std::filesystem::path& path) {
+    std::ifstream fin(path);
+    if (!fin.is_open())
+        die("Unable to open manifest: %s\n", strerror(errno));
+
+    std::vector<std::pair<std::string, std::string>> lines;
+    std::string line;
+    while (std::getline(fin, line)) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        size_t last = line.find_last_not_of(" \t\r");
+        line = line.substr(first, last - first + 1);
+        size_t sep = line.find_first_of(" \t");
+        if (sep == std::string::npos)
+            lines.emplace_back(line, "");
+        else
+            lines.emplace_back(line.substr(0, sep),
+                    line.substr(line.find_first_not_of(" \t", sep)));
+    }
+    return lines;
+}
+
+// in-file arguments modify these, so they are restored for every song
+struct song_args {
+    song_args()
+        : vgr(arg_vgr), mvl(arg_mvl), pri(arg_pri), rev(arg_rev),
+        natural(arg_natural), modt(arg_modt), lfos(arg_lfos), lfodl(arg_lfodl),
+        modt_global(arg_modt_global), lfos_global(arg_lfos_global),
+        lfodl_global(arg_lfodl_global), mod_scale(arg_mod_scale) {}
+
+    void restore() const {
+        arg_sym.clear();
+        arg_vgr = vgr;
+        arg_mvl = mvl;
+        arg_pri = pri;
+        arg_rev = rev;
+        arg_natural = natural;
+        arg_modt = modt;
+        arg_lfos = lfos;
+        arg_lfodl = lfodl;
+        arg_modt_global = modt_global;
+        arg_lfos_global = lfos_global;
+        arg_lfodl_global = lfodl_global;
+        arg_mod_scale = mod_scale;
+        mf.midi_tracks.clear();
+        as.tracks.clear();
+    }
+
+    std::string vgr;
+    uint8_t mvl, pri, rev;
+    bool natural;
+    uint8_t modt, lfos, lfodl;
+    bool modt_global, lfos_global, lfodl_global;
+    float mod_scale;
+};
+
+static void batch_convert() {
+    std::vector<batch_entry> entries;
+    for (const auto& line : manifest_read(arg_batch_file)) {
+        batch_entry entry;
+        entry.input = line.first;
+        if (line.second.empty()) {
+            entry.output = entry.input;
+            entry.output.replace_extension("s");
+        } else {
+            entry.output = line.second;
+        }
+        entry.input_size = std::filesystem::file_size(entry.input);
+        entries.emplace_back(std::move(entry));
+    }
+
+    // assign the largest songs first, each to the least loaded shard
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return entries[a].input_size > entries[b].input_size;
+    });
+    std::vector<uintmax_t> shard_load(arg_shard_count, 0);
+    std::vector<bool> in_shard(entries.size(), false);
+    for (size_t ientry : order) {
+        size_t min_shard = static_cast<size_t>(
+                std::min_element(shard_load.begin(), shard_load.end()) - shard_load.begin());
+        shard_load[min_shard] += entries[ientry].input_size;
+        in_shard[ientry] = min_shard + 1 == arg_shard_index;
+    }
+
+    if (arg_summary_file.empty()) {
+        arg_summary_file = arg_batch_file;
+        arg_summary_file.replace_extension(std::to_string(arg_shard_index) +
+                "-of-" + std::to_string(arg_shard_count) + ".summary");
+    }
+    std::ofstream fsum(arg_summary_file, std::ios::out);
+    if (!fsum.is_open())
+        die("Unable to open summary file: %s\n", strerror(errno));
+
+    const song_args args;
+
+    size_t num_converted = 0;
+    for (size_t ientry = 0; ientry < entries.size(); ientry++) {
+        if (!in_shard[ientry])
+            continue;
+        const batch_entry& entry = entries[ientry];
+
+        args.restore();
+        arg_input_file = entry.input;
+        arg_output_file = entry.output;
+        arg_output_file_read = true;
+
+        dbg("batch: converting %s\n", entry.input.string().c_str());
+        convert_song();
+        batch_write_summary(fsum, entry);
+        num_converted += 1;
+    }
+
+    if (fsum.bad() || fsum.fail())
+        die("Unable to write summary file\n");
+    dbg("batch: shard %u/%u converted %zu of %zu songs\n", arg_shard_index,
+            arg_shard_count, num_converted, entries.size());
+}
+
+/*
+ * Sound effect bank:
+ *
+ * One-shot SFX are tiny, so the header of a separate file per SFX costs
+ * more assembler time than the SFX itself. --sfx-bank converts all songs
+ * of a manifest ("<input> [<music player>]" per line) into one file. Every
+ * SFX runs through the passes on its own, instead of being written its
+ * tracks are collected. Identical tracks are only written once and the
+ * pattern detection runs over all SFX together, so bars can be shared
+ * between them. The song headers follow one after another and
+ * <output>_table.inc contains the song table entries.
+ */
+struct sfx_bank_song {
+    std::string sym, vgr;
+    uint8_t pri, rev;
+    unsigned player;
+    // indices into sfx_bank_tracks
+    std::vector<size_t> tracks;
+};
+
+static std::vector<sfx_bank_song> sfx_bank_songs;
+static std::vector<agb_track> sfx_bank_tracks;
+static std::vector<int> sfx_bank_channels;
+static std::unordered_map<size_t, std::vector<size_t>> sfx_bank_track_hashes;
+static size_t sfx_bank_num_shared = 0;
+
+static void sfx_bank_add() {
+    using namespace cppmidi;
+
+    sfx_bank_song song;
+    song.sym = arg_sym;
+    song.vgr = arg_vgr;
+    song.pri = arg_pri;
+    song.rev = arg_rev;
+    song.player = 0;
+    for (size_t itrk = 0; itrk < as.tracks.size(); itrk++) {
+        agb_track& atrk = as.tracks[itrk];
+        size_t hash = atrk.bars.size();
+        for (const agb_bar& abar : atrk.bars)
+            hash = hash * 0x100000001B3ull + abar.hash();
+
+        size_t index = sfx_bank_tracks.size();
+        for (size_t other : sfx_bank_track_hashes[hash]) {
+            const agb_track& otrk = sfx_bank_tracks[other];
+            if (otrk.bars.size() != atrk.bars.size())
+                continue;
+            if (std::equal(otrk.bars.begin(), otrk.bars.end(), atrk.bars.begin())) {
+                index = other;
+                break;
+            }
+        }
+        if (index == sfx_bank_tracks.size()) {
+            sfx_bank_track_hashes[hash].push_back(index);
+            sfx_bank_tracks.emplace_back(std::move(atrk));
+            sfx_bank_channels.push_back(trk_get_channel_num(mf[itrk]));
+        } else {
+            sfx_bank_num_shared += 1;
+        }
+        song.tracks.push_back(index);
+    }
+    sfx_bank_songs.emplace_back(std::move(song));
+}
+
+static void sfx_bank_convert() {
+    const std::filesystem::path output = arg_output_file;
+    std::string bank_sym = arg_sym;
+    if (bank_sym.empty()) {
+        bank_sym = output.filename().replace_extension("").string();
+        fix_str(bank_sym);
+    }
+
+    const song_args args;
+    std::unordered_set<std::string> syms;
+    for (const auto& line : manifest_read(arg_sfx_bank_file)) {
+        args.restore();
+        arg_input_file = line.first;
+        arg_output_file = output;
+        arg_output_file_read = true;
+        arg_sym = arg_input_file.filename().replace_extension("").string();
+        fix_str(arg_sym);
+        int player = line.second.empty() ? 1 : std::stoi(line.second);
+        if (player < 0 || player > 0xFFFF)
+            die("--sfx-bank: music player %d out of range\n", player);
+
+        dbg("sfx bank: converting %s\n", line.first.c_str());
+        convert_song();
+        sfx_bank_songs.back().player = static_cast<unsigned>(player);
+        if (!syms.insert(sfx_bank_songs.back().sym).second)
+            die("--sfx-bank: symbol %s is used twice\n", sfx_bank_songs.back().sym.c_str());
+    }
+
+    // all SFX are written like one song with many tracks
+    as.tracks = std::move(sfx_bank_tracks);
+    arg_sym = bank_sym;
+
+    std::ofstream fout(output, std::ios::out);
+    if (!fout.is_open())
+        die("Unable to open output file: %s\n", strerror(errno));
+    if (arg_lean_asm)
+        lean_asm_init();
+
+    agb_find_patterns();
+
+    agb_out(fout, "        .include \"MPlayDef.s\"\n\n");
+    agb_out(fout, "        .equ    %s_key, 0\n\n", bank_sym.c_str());
+    agb_out(fout, "        .section .rodata\n");
+    agb_out(fout, "        .align  2\n\n");
+    write_agb_tracks(fout, sfx_bank_channels, 0, as.tracks.size());
+
+    agb_out(fout, "\n");
+    agb_comment_line(fout, "Song Headers");
+    for (const sfx_bank_song& song : sfx_bank_songs) {
+        agb_out(fout, "\n        .global %s\n", song.sym.c_str());
+        agb_out(fout, "        .align  2\n");
+        agb_out(fout, "%s:\n", song.sym.c_str());
+        agb_out(fout, "        .byte   %-23zu @ Num Tracks\n", song.tracks.size());
+        agb_out(fout, "        .byte   %-23zu @ Unknown\n", 0);
+        agb_out(fout, "        .byte   %-23d @ Priority\n", song.pri);
+        if (song.rev > 0)
+            agb_out(fout, "        .byte   %d+reverb_set%-12s @ Reverb\n", song.rev, "");
+        else
+            agb_out(fout, "        .byte   %-23d @ Reverb\n", 0);
+        agb_out(fout, "        .word   %-23s\n", song.vgr.c_str());
+        for (size_t itrk : song.tracks)
+            agb_out(fout, "        .word   %s_%zu\n", bank_sym.c_str(), itrk);
+    }
+    agb_out(fout, "\n        .end\n");
+
+    if (fout.bad() || fout.fail())
+        die("Unable to write output file\n");
     fout.close();
+
+    std::filesystem::path table_file = output;
+    table_file.replace_filename(output.stem().string() + "_table.inc");
+    std::ofstream ftab(table_file, std::ios::out);
+    if (!ftab.is_open())
+        die("Unable to open song table file: %s\n", strerror(errno));
+    ftab << "@ song table entries for " << output.filename().string() << "\n";
+    for (const sfx_bank_song& song : sfx_bank_songs) {
+        ftab << "        .4byte  " << song.sym << "\n";
+        ftab << "        .2byte  " << song.player << ", " << song.player << "\n";
+    }
+    if (ftab.bad() || ftab.fail())
+        die("Unable to write song table file\n");
+
+    dbg("sfx bank: %zu SFX, %zu tracks, %zu identical tracks shared\n",
+            sfx_bank_songs.size(), as.tracks.size(), sfx_bank_num_shared);
+}
+
+static void batch_merge_summaries() {
+    struct bar_candidate {
+        size_t size = 0;
+        std::vector<std::string> songs;
+    };
+
+    size_t num_songs = 0, total_size = 0, total_bars = 0;
+    // keyed by fingerprint and size of the bar
+    std::map<std::pair<uint64_t, size_t>, bar_candidate> candidates;
+
+    for (const std::filesystem::path& path : arg_merge_files) {
+        std::ifstream fin(path);
+        if (!fin.is_open())
+            die("Unable to open summary file %s: %s\n", path.string().c_str(),
+                    strerror(errno));
+        std::string line;
+        while (std::getline(fin, line)) {
+            char song[4096];
+            size_t size, bars;
+            unsigned long long fp;
+            if (sscanf(line.c_str(), "song %zu %zu %4095[^\n]", &size, &bars, song) == 3) {
+                num_songs += 1;
+                total_size += size;
+                total_bars += bars;
+                printf("song %8zu bytes %6zu bars  %s\n", size, bars, song);
+            } else if (sscanf(line.c_str(), "bar %llx %zu %4095[^\n]", &fp, &size, song) == 3) {
+                bar_candidate& cand = candidates[{fp, size}];
+                cand.size = size;
+                cand.songs.emplace_back(song);
+            }
+        }
+    }
+
+    printf("total %zu songs, %zu bytes, %zu bars\n", num_songs, total_size, total_bars);
+
+    // bars used by more than one song could be shared
+    std::vector<std::pair<size_t, std::pair<uint64_t, size_t>>> shared;
+    for (const auto& cand : candidates) {
+        if (cand.second.songs.size() > 1) {
+            size_t savings = (cand.second.songs.size() - 1) * (cand.second.size - 5);
+            shared.emplace_back(savings, cand.first);
+        }
+    }
+    std::sort(shared.begin(), shared.end(), std::greater<>());
+    size_t total_savings = 0;
+    for (const auto& sh : shared) {
+        const bar_candidate& cand = candidates[sh.second];
+        printf("shared bar %016llx: %zu bytes in %zu songs, saves %zu bytes\n",
+                static_cast<unsigned long long>(sh.second.first), cand.size,
+                cand.songs.size(), sh.first);
+        for (const std::string& song : cand.songs)
+            printf("    %s\n", song.c_str());
+        total_savings += sh.first;
+    }
+    printf("total %zu shared bar candidates, %zu bytes savable\n",
+            shared.size(), total_savings);
 }
 
 static void dbg(const char *msg, ...) {
@@ -0,0 +1,141 @@
+#include "fixed_stream.h"
+
+#include <string.h>
+
+typedef char m2a_fs_event_size_check[sizeof(struct m2a_fs_event) == 8 ? 1 : -1];
+
+void m2a_fs_init(struct m2a_fs_player *player, const struct m2a_fs_song *song,
+        const struct m2a_fs_callbacks *cb)
+{
+    unsigned int i;
+
+    memset(player, 0, sizeof(*player));
+    player->song = song;
+    player->cb = *cb;
+    /* 150 bpm = one tick per frame, same default as the m4a engine */
+    player->tempo = 150;
+
+    for (i = 0; i < song->num_tracks && i < M2A_FS_MAX_TRACKS; i++) {
+        struct m2a_fs_track *trk = &player->tracks[i];
+        trk->start = song->tracks[i];
+        trk->pos = song->tracks[i];
+        trk->active = 1;
+        trk->vol = 100;
+        trk->pan = 64;
+        trk->bend = 64;
+        trk->bendr = 2;
+        trk->lfos = 22;
+        trk->tune = 64;
+    }
+}
+
+static void m2a_fs_track_tick(struct m2a_fs_player *player, unsigned int itrk)
+{
+    struct m2a_fs_track *trk = &player->tracks[itrk];
+
+    if (trk->wait > 0) {
+        trk->wait--;
+        if (trk->wait > 0)
+            return;
+    }
+
+    while (trk->active && trk->wait == 0) {
+        const struct m2a_fs_event *ev = trk->pos++;
+
+        switch (ev->cmd) {
+        case M2A_FS_WAIT:
+            break;
+        case M2A_FS_FINE:
+            trk->active = 0;
+            return;
+        case M2A_FS_GOTO:
+            trk->pos = trk->start + (ev->delta | ((uint32_t)ev->len << 16));
+            continue;
+        case M2A_FS_PRIO:
+            trk->prio = ev->arg0;
+            break;
+        case M2A_FS_TEMPO:
+            player->tempo = (uint16_t)(ev->arg0 * 2);
+            break;
+        case M2A_FS_KEYSH:
+            trk->keysh = (int8_t)ev->arg0;
+            break;
+        case M2A_FS_VOICE:
+            trk->voice = ev->arg0;
+            break;
+        case M2A_FS_VOL:
+            trk->vol = ev->arg0;
+            break;
+        case M2A_FS_PAN:
+            trk->pan = ev->arg0;
+            break;
+        case M2A_FS_BEND:
+            trk->bend = ev->arg0;
+            break;
+        case M2A_FS_BENDR:
+            trk->bendr = ev->arg0;
+            break;
+        case M2A_FS_LFOS:
+            trk->lfos = ev->arg0;
+            break;
+        case M2A_FS_LFODL:
+            trk->lfodl = ev->arg0;
+            break;
+        case M2A_FS_MOD:
+            trk->mod = ev->arg0;
+            break;
+        case M2A_FS_MODT:
+            trk->modt = ev->arg0;
+            break;
+        case M2A_FS_TUNE:
+            trk->tune = ev->arg0;
+            break;
+        case M2A_FS_XCMD:
+            trk->xcmd[ev->arg0 & 0xF] = ev->arg1;
+            break;
+        case M2A_FS_EOT:
+            if (player->cb.note_off)
+                player->cb.note_off(player->cb.user, itrk,
+                        (uint8_t)(ev->arg0 + trk->keysh));
+            break;
+        case M2A_FS_TIE:
+        case M2A_FS_NOTE:
+            if (player->cb.note_on)
+                player->cb.note_on(player->cb.user, itrk,
+                        (uint8_t)(ev->arg0 + trk->keysh), ev->arg1, ev->len);
+            break;
+        default:
+            /* corrupt stream */
+            trk->active = 0;
+            return;
+        }
+        trk->wait = ev->delta;
+    }
+}
+
+int m2a_fs_tick(struct m2a_fs_player *player)
+{
+    unsigned int i;
+    int active = 0;
+
+    for (i = 0; i < player->song->num_tracks && i < M2A_FS_MAX_TRACKS; i++) {
+        if (!player->tracks[i].active)
+            continue;
+        m2a_fs_track_tick(player, i);
+        active |= player->tracks[i].active;
+    }
+    player->ticks++;
+    return active;
+}
+
+int m2a_fs_frame(struct m2a_fs_player *player)
+{
+    int active = 1;
+
+    player->tempo_counter = (uint16_t)(player->tempo_counter + player->tempo);
+    while (player->tempo_counter >= 150) {
+        active = m2a_fs_tick(player);
+        player->tempo_counter = (uint16_t)(player->tempo_counter - 150);
+    }
+    return active;
+}
@@ -0,0 +1,119 @@
+/*
+ * Reference decoder for the fixed-width event stream written by
+ * "midi2agb --fixed-stream".
+ *
+ * Every event is two aligned 32 bit words, so a player can fetch it with a
+ * single ldm and never has to track running status:
+ *
+ *   word 0: cmd | arg0 << 8 | arg1 << 16 | arg2 << 24
+ *   word 1: delta | len << 16
+ *
+ * delta is the number of ticks to wait after the event. len is the absolute
+ * duration of a NOTE or TIE in ticks. A TIE still lasts until its EOT, len
+ * is only 0xFFFF if the EOT is 65535 or more ticks away or follows after
+ * the loop jump.
+ * GOTO uses the whole second word as index of the target event within the
+ * track. Patterns are expanded, so the stream is larger than the MPlayDef
+ * one, but the decoder only needs a table lookup per event.
+ *
+ * The song header has the same layout as the one of the m4a engine.
+ */
+#ifndef M2A_FIXED_STREAM_H
+#define M2A_FIXED_STREAM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum m2a_fs_cmd {
+    M2A_FS_WAIT = 0,
+    M2A_FS_FINE,
+    M2A_FS_GOTO,
+    M2A_FS_PRIO,
+    M2A_FS_TEMPO,   /* arg0 = bpm / 2 */
+    M2A_FS_KEYSH,   /* arg0 = signed key shift */
+    M2A_FS_VOICE,
+    M2A_FS_VOL,
+    M2A_FS_PAN,     /* arg0 = 64 + pan */
+    M2A_FS_BEND,    /* arg0 = 64 + bend */
+    M2A_FS_BENDR,
+    M2A_FS_LFOS,
+    M2A_FS_LFODL,
+    M2A_FS_MOD,
+    M2A_FS_MODT,
+    M2A_FS_TUNE,    /* arg0 = 64 + tune */
+    M2A_FS_XCMD,    /* arg0 = type, arg1 = parameter */
+    M2A_FS_EOT,     /* arg0 = key */
+    M2A_FS_TIE,     /* arg0 = key, arg1 = velocity, len = ticks until EOT */
+    M2A_FS_NOTE,    /* arg0 = key, arg1 = velocity, len = duration */
+    M2A_FS_NUM_CMDS
+};
+
+/* len of a TIE whose EOT couldn't be resolved */
+#define M2A_FS_TIE_LEN 0xFFFF
+
+struct m2a_fs_event {
+    uint8_t cmd;
+    uint8_t arg0;
+    uint8_t arg1;
+    uint8_t arg2;
+    uint16_t delta;
+    uint16_t len;
+};
+
+struct m2a_fs_song {
+    uint8_t num_tracks;
+    uint8_t unknown;
+    uint8_t priority;
+    uint8_t reverb;
+    const void *voicegroup;
+    const struct m2a_fs_event *tracks[];
+};
+
+#define M2A_FS_MAX_TRACKS 16
+
+struct m2a_fs_track {
+    const struct m2a_fs_event *start;
+    const struct m2a_fs_event *pos;
+    uint16_t wait;
+    uint8_t active;
+    int8_t keysh;
+    uint8_t prio, voice, vol, pan, bend, bendr;
+    uint8_t lfos, lfodl, mod, modt, tune;
+    uint8_t xcmd[16];
+};
+
+/*
+ * Called for every note, the track state holds the current voice, volume
+ * etc. Keys already include the key shift.
+ */
+struct m2a_fs_callbacks {
+    void (*note_on)(void *user, unsigned int track, uint8_t key,
+            uint8_t vel, uint16_t len);
+    void (*note_off)(void *user, unsigned int track, uint8_t key);
+    void *user;
+};
+
+struct m2a_fs_player {
+    const struct m2a_fs_song *song;
+    struct m2a_fs_callbacks cb;
+    struct m2a_fs_track tracks[M2A_FS_MAX_TRACKS];
+    uint16_t tempo;
+    uint16_t tempo_counter;
+    uint32_t ticks;
+};
+
+void m2a_fs_init(struct m2a_fs_player *player, const struct m2a_fs_song *song,
+        const struct m2a_fs_callbacks *cb);
+/* processes one tick, returns 0 once all tracks are finished */
+int m2a_fs_tick(struct m2a_fs_player *player);
+/* processes the ticks of one 60 Hz frame like the m4a engine does */
+int m2a_fs_frame(struct m2a_fs_player *player);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif